@@ -0,0 +1,76 @@
+#include "matrix.hpp" // dense solvers
+#include <iostream>   // in-out
+#include <random>     // random matrices
+#include <chrono>     // evaluation time
+
+/**
+ * Micro-benchmark: gaussElimination x LU (blocked kernel)
+ * n = 8..512, random diagonally dominant systems (no row swaps) and
+ * general ones (the pivot of most columns is found below the diagonal)
+ */
+
+/**
+ * Fills a random system, dominant or not
+ */
+void randomSystem(mat &coeff, mat &equals, bool dominant, std::default_random_engine &generator){
+  std::uniform_real_distribution<double> distribution(-1.0,1.0);
+  const int n = coeff.rows;
+  for (int i=0; i<n; ++i){
+    for (int j=0; j<n; ++j){
+      coeff.set(i,j,distribution(generator)+(dominant && i==j ? n : 0));
+    }
+    equals.set(i,0,distribution(generator));
+  }
+}
+
+/**
+ * Largest difference between two vectors
+ */
+double maxDiff(const mat &a, const mat &b){
+  double ans = 0;
+  for (int i=0; i<a.rows; ++i){
+    ans = std::max(ans,std::abs(a.get(i,0)-b.get(i,0)));
+  }
+  return ans;
+}
+
+int main(){
+  std::default_random_engine generator(42);
+  std::cout << "system\tn\tgauss [us]\tLU [us]\tspeedup\tmax diff" << std::endl;
+  for (bool dominant:{true,false}){
+    for (int n=8; n<=512; n*=2){
+      mat coeff(n,n);
+      mat equals(n,1);
+      randomSystem(coeff,equals,dominant,generator);
+      const int reps = std::max(1,(1<<24)/(n*n*n)); // similar work for each n
+
+      // Current routine (overwrites its inputs)
+      mat gauss(n,1);
+      auto t1 = std::chrono::high_resolution_clock::now();
+      for (int r=0; r<reps; ++r){
+        mat c(coeff);
+        mat e(equals);
+        gauss = gaussElimination(c,e);
+      }
+      auto t2 = std::chrono::high_resolution_clock::now();
+
+      // Blocked LU with workspace
+      std::vector<double> store(n*n);
+      std::vector<int> perm(n);
+      LU lu(n,store.data(),perm.data());
+      mat blocked(n,1);
+      auto t3 = std::chrono::high_resolution_clock::now();
+      for (int r=0; r<reps; ++r){
+        lu.factor(coeff);
+        lu.solve(equals.eArray,blocked.eArray);
+      }
+      auto t4 = std::chrono::high_resolution_clock::now();
+
+      const double tg = std::chrono::duration<double,std::micro>(t2-t1).count()/reps;
+      const double tl = std::chrono::duration<double,std::micro>(t4-t3).count()/reps;
+      std::cout << (dominant ? "dominant" : "general") << "\t"
+		<< n << "\t" << tg << "\t" << tl << "\t" << tg/tl << "\t" << maxDiff(gauss,blocked) << std::endl;
+    }
+  }
+  return 0;
+}
@@ -1,10 +1,85 @@
 #include "text.hpp"   // input text and manipulation
 #include "reduce.hpp" // block solver and problem solver
+#include "sweep.hpp"  // parametric sweeps
 #include <chrono>     // evaluation time
 
-int main(){
-  std::cout << "Laine | C++ console version" << std::endl;
+/**
+ * Sweep mode: laine model.txt points.txt
+ * prints a csv with every variable at each point (nan if it failed)
+ */
+int sweepMode(std::string modelFile, std::string pointsFile){
+  const auto t1 = std::chrono::high_resolution_clock::now();
+  Sweep table = getSweepFromFile(pointsFile);
+  Model* compiled = openModel(modelFile,table.names);
+  const Model &model = *compiled;
+  std::vector<Scope> results = sweep(model,table);
+  const auto t2 = std::chrono::high_resolution_clock::now();
+  const auto ms_int= std::chrono::duration_cast<std::chrono::microseconds>(t2-t1);
+
+  // Variables in alphabetical order
+  Scope header;
+  for (const auto &name:model.names()){
+    header[name] = 0;
+  }
+  unsigned i = 0;
+  for (const auto &kv:header){
+    std::cout << (i++ ? "," : "") << kv.first;
+  }
+  std::cout << std::endl;
+  unsigned failed = 0;
+  for (const auto &point:results){
+    failed += point.empty();
+    i = 0;
+    for (const auto &kv:header){
+      auto it = point.find(kv.first);
+      std::cout << (i++ ? "," : "");
+      if (it == point.end()){
+	std::cout << "nan";
+      } else{
+	std::cout << it->second;
+      }
+    }
+    std::cout << std::endl;
+  }
+  std::cerr << "Time: "<< ms_int.count()/1e3<< " ms, " << results.size() << " points, "
+	    << failed << " failed" << std::endl;
+  if (propsCache.misses > 0){
+    std::cerr << "Properties: " << propsCache.misses << " computed, "
+	      << propsCache.hits << " cached" << std::endl;
+  }
+  delete compiled;
+  return 0;
+}
+
+/**
+ * Compile mode: laine -c model.txt model.lnb [points.txt]
+ * saves the analyzed model, the parameters are the names of the points
+ * a compiled model is opened like a text file, see Model::load
+ */
+int compileMode(std::string modelFile, std::string outFile, std::string pointsFile){
+  const auto t1 = std::chrono::high_resolution_clock::now();
+  std::vector<std::string> parameters;
+  if (!pointsFile.empty()){
+    parameters = getSweepFromFile(pointsFile).names;
+  }
+  Model model(getLinesFromFile(modelFile),parameters);
+  model.save(outFile);
+  const auto t2 = std::chrono::high_resolution_clock::now();
+  const auto ms_int= std::chrono::duration_cast<std::chrono::microseconds>(t2-t1);
+  std::cerr << "Compiled: "<< ms_int.count()/1e3<< " ms" << std::endl;
+  return 0;
+}
+
+int main(int argc, char** argv){
   srand(time(NULL)); // seed for random numbers
+  if ((argc == 4 || argc == 5) && std::string(argv[1]) == "-c"){
+    return compileMode(argv[2],argv[3],argc == 5 ? argv[4] : "");
+  }
+  if (argc == 3){
+    return sweepMode(argv[1],argv[2]);
+  }
+  std::cout << "Laine | C++ console version" << std::endl;
+  Scope previous; // first guess of the next problem
   
   while (true){
       
@@ -14,18 +89,34 @@ int main(){
     std::cout << "Filename: ";
     std::string filename;
     std::cin >> filename;
-    std::vector<std::string> lines = getLinesFromFile(filename);
+
+    /**
+     * Analyze problem once (or load it compiled)
+     **/
+    const auto t0 = std::chrono::high_resolution_clock::now();
+    Model* compiled = openModel(filename);
+    const Model &model = *compiled;
+    const auto ms_model = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now()-t0);
+    std::cout << "Analysis: "<< ms_model.count()/1e3<< " ms" << std::endl;
     
+    bool first = true;
     while (true){
       /**
-       * Solve problem
+       * Solve problem (a new problem starts from the last solution)
        **/
       const auto t1 = std::chrono::high_resolution_clock::now(); // start chrono
-      Scope solutions;
-      solveProblem(lines,solutions);
+      const Scope* warm = first && !previous.empty() ? &previous : nullptr;
+      propsCache.resetCounters(); // hits and misses of this solve
+      Scope solutions = model.solve(Scope(),warm);
+      previous = solutions;
+      first = false;
       const auto t2 = std::chrono::high_resolution_clock::now();
       const auto ms_int= std::chrono::duration_cast<std::chrono::microseconds>(t2-t1);
       std::cout << "Time: "<< ms_int.count()/1e3<< " ms" << std::endl;
+      if (propsCache.misses > 0){
+	std::cout << "Properties: " << propsCache.misses << " computed, "
+		  << propsCache.hits << " cached" << std::endl;
+      }
 
       /**
        * Print results
@@ -45,6 +136,7 @@ int main(){
       }
       
     }
+    delete compiled;
 
     // New file?
     char newFile = 'x';
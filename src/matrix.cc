@@ -1,4 +1,7 @@
 #include "matrix.hpp"
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h> // SIMD kernels
+#endif
 //#include <emscripten.h> // wasm
 
 /**
@@ -231,3 +234,346 @@ mat gaussElimination(mat& coeff, mat& equals){
   }
   return answer;
 }
+
+/**
+ * LU constructor
+ */
+LU::LU(int size, double* store, int* perm){
+  n = size;
+  a = store;
+  pivot = perm;
+}
+
+/**
+ * Inner loop of the elimination: y = y + alpha*x
+ * AVX-512 or AVX2 kernels when available, otherwise portable code
+ */
+static inline void axpy(int n, double alpha, const double* x, double* y){
+  int j = 0;
+#if defined(__AVX512F__)
+  const __m512d a = _mm512_set1_pd(alpha);
+  for (; j+8<=n; j+=8){
+    _mm512_storeu_pd(y+j,_mm512_fmadd_pd(a,_mm512_loadu_pd(x+j),_mm512_loadu_pd(y+j)));
+  }
+#elif defined(__AVX2__) && defined(__FMA__)
+  const __m256d a = _mm256_set1_pd(alpha);
+  for (; j+4<=n; j+=4){
+    _mm256_storeu_pd(y+j,_mm256_fmadd_pd(a,_mm256_loadu_pd(x+j),_mm256_loadu_pd(y+j)));
+  }
+#endif
+  for (; j<n; ++j){
+    y[j] += alpha*x[j];
+  }
+}
+
+/**
+ * Rank-4 update of a row: y = y - l0*x0 - l1*x1 - l2*x2 - l3*x3
+ * rows x are ld apart, y is loaded and stored once
+ */
+static inline void update4(int n, const double* l, const double* x, int ld, double* y){
+  const double* x0 = x;
+  const double* x1 = x+ld;
+  const double* x2 = x+2*ld;
+  const double* x3 = x+3*ld;
+  int j = 0;
+#if defined(__AVX512F__)
+  const __m512d a0 = _mm512_set1_pd(-l[0]);
+  const __m512d a1 = _mm512_set1_pd(-l[1]);
+  const __m512d a2 = _mm512_set1_pd(-l[2]);
+  const __m512d a3 = _mm512_set1_pd(-l[3]);
+  for (; j+8<=n; j+=8){
+    __m512d v = _mm512_loadu_pd(y+j);
+    v = _mm512_fmadd_pd(a0,_mm512_loadu_pd(x0+j),v);
+    v = _mm512_fmadd_pd(a1,_mm512_loadu_pd(x1+j),v);
+    v = _mm512_fmadd_pd(a2,_mm512_loadu_pd(x2+j),v);
+    v = _mm512_fmadd_pd(a3,_mm512_loadu_pd(x3+j),v);
+    _mm512_storeu_pd(y+j,v);
+  }
+#elif defined(__AVX2__) && defined(__FMA__)
+  const __m256d a0 = _mm256_set1_pd(-l[0]);
+  const __m256d a1 = _mm256_set1_pd(-l[1]);
+  const __m256d a2 = _mm256_set1_pd(-l[2]);
+  const __m256d a3 = _mm256_set1_pd(-l[3]);
+  for (; j+4<=n; j+=4){
+    __m256d v = _mm256_loadu_pd(y+j);
+    v = _mm256_fmadd_pd(a0,_mm256_loadu_pd(x0+j),v);
+    v = _mm256_fmadd_pd(a1,_mm256_loadu_pd(x1+j),v);
+    v = _mm256_fmadd_pd(a2,_mm256_loadu_pd(x2+j),v);
+    v = _mm256_fmadd_pd(a3,_mm256_loadu_pd(x3+j),v);
+    _mm256_storeu_pd(y+j,v);
+  }
+#endif
+  for (; j<n; ++j){
+    y[j] -= l[0]*x0[j] + l[1]*x1[j] + l[2]*x2[j] + l[3]*x3[j];
+  }
+}
+
+/**
+ * LU factorization: PA = LU
+ * blocked right-looking elimination: a panel of columns is factored,
+ * then the trailing columns are updated in cache-sized chunks
+ * small matrices are a single panel, blocking only pays off from about
+ * n = 128 (see bench.cc)
+ * returns false if the matrix is singular
+ */
+bool LU::factor(const mat &coeff){
+  const int blocked_min = 128;
+  const int nb = n < blocked_min ? n : 32; // panel width
+  const int chunk = 256; // columns updated at once
+  std::copy(coeff.eArray,coeff.eArray+n*n,a);
+  for (int k0=0; k0<n; k0+=nb){
+    const int k1 = std::min(k0+nb,n);
+    
+    // Panel factorization
+    for (int k=k0; k<k1; ++k){
+      // Pivot: largest value of the column
+      int p = k;
+      double big = std::abs(a[k+k*n]);
+      for (int i=k+1; i<n; ++i){
+	if (std::abs(a[k+i*n]) > big){
+	  big = std::abs(a[k+i*n]);
+	  p = i;
+	}
+      }
+      pivot[k] = p;
+      if (big == 0 || !std::isfinite(big)){
+	return false;
+      }
+      if (p != k){
+	std::swap_ranges(a+k*n,a+(k+1)*n,a+p*n);
+      }
+      // Elimination - multipliers and panel columns only
+      const double* row = a+k*n;
+      for (int i=k+1; i<n; ++i){
+	double* obj = a+i*n;
+	if (obj[k] != 0){
+	  obj[k] /= row[k];
+	  axpy(k1-k-1,-obj[k],row+k+1,obj+k+1);
+	}
+      }
+    }
+
+    // Trailing update: rows of the panel (triangular) and below (product)
+    for (int j0=k1; j0<n; j0+=chunk){
+      const int m = std::min(chunk,n-j0);
+      for (int i=k0+1; i<n; ++i){
+	double* obj = a+i*n;
+	const int pend = std::min(i,k1);
+	int p = k0;
+	for (; p+4<=pend; p+=4){
+	  update4(m,obj+p,a+p*n+j0,n,obj+j0);
+	}
+	for (; p<pend; ++p){
+	  axpy(m,-obj[p],a+p*n+j0,obj+j0);
+	}
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * Solves LUx = Pb
+ * b and x may be the same array
+ */
+void LU::solve(const double* b, double* x) const{
+  if (x != b){
+    std::copy(b,b+n,x);
+  }
+  // Forward substitution (with row swaps)
+  for (int k=0; k<n; ++k){
+    std::swap(x[k],x[pivot[k]]);
+  }
+  for (int i=1; i<n; ++i){
+    const double* row = a+i*n;
+    double aux = 0;
+    for (int j=0; j<i; ++j){
+      aux += row[j]*x[j];
+    }
+    x[i] -= aux;
+  }
+  // Backward substitution
+  for (int i=n-1; i>=0; --i){
+    const double* row = a+i*n;
+    double aux = 0;
+    for (int j=i+1; j<n; ++j){
+      aux += row[j]*x[j];
+    }
+    x[i] = (x[i]-aux)/row[i];
+  }
+}
+
+/**
+ * spmat constructor
+ * builds a zero matrix with the sorted columns of each row as non-zeros
+ */
+spmat::spmat(int r, int c, const std::vector<std::vector<int>> &pattern){
+  rows = r;
+  columns = c;
+  start.push_back(0);
+  for (int i=0; i<r; ++i){
+    index.insert(index.end(),pattern[i].begin(),pattern[i].end());
+    start.push_back(index.size());
+  }
+  values.assign(index.size(),0);
+}
+
+/**
+ * Sparse row: sorted pairs of column and value
+ */
+using SparseRow = std::vector<std::pair<int,double>>;
+
+/**
+ * Finds the value of a column in a sparse row
+ */
+double getSparse(const SparseRow &row, int column){
+  auto it = std::lower_bound(row.begin(),row.end(),column,
+			     [](const std::pair<int,double> &entry, int c){return entry.first < c;});
+  if (it != row.end() && it->first == column){
+    return it->second;
+  }
+  return 0;
+}
+
+/**
+ * Solver for sparse linear systems: 
+ * Gaussian elimination with Markowitz pivoting (fill-reducing)
+ * and threshold partial pivoting (|pivot| >= 0.1 max of its column)
+ */
+mat sparseElimination(const spmat& coeff, const mat& equals){
+  const int n = coeff.rows;
+  const double threshold = 0.1;
+  mat answer(n,1);
+
+  // Working copy
+  std::vector<SparseRow> rows(n);
+  std::vector<std::vector<int>> colRows(n); // rows of each column (may be outdated)
+  std::vector<int> colCount(n,0);
+  std::vector<double> rhs(n);
+  for (int i=0; i<n; ++i){
+    for (int k=coeff.start[i]; k<coeff.start[i+1]; ++k){
+      rows[i].push_back(std::make_pair(coeff.index[k],coeff.values[k]));
+      colRows[coeff.index[k]].push_back(i);
+      ++colCount[coeff.index[k]];
+    }
+    rhs[i] = equals.get(i,0);
+  }
+  std::vector<bool> activeRow(n,true);
+  std::vector<bool> activeCol(n,true);
+  std::vector<std::pair<int,int>> pivots; // row and column
+  SparseRow merged;
+
+  for (int step=0; step<n; ++step){
+    // Pivot: lowest Markowitz cost (rows-1)*(columns-1) among stable values
+    int pr = -1;
+    int pc = -1;
+    long cost = -1;
+    double pivot = 0;
+    for (int c=0; c<n && cost != 0; ++c){
+      if (!activeCol[c]){
+	continue;
+      }
+      double colMax = 0;
+      for (const auto &i:colRows[c]){
+	if (activeRow[i]){
+	  colMax = std::max(colMax,std::abs(getSparse(rows[i],c)));
+	}
+      }
+      if (colMax == 0){
+	continue;
+      }
+      for (const auto &i:colRows[c]){
+	if (!activeRow[i]){
+	  continue;
+	}
+	const double value = getSparse(rows[i],c);
+	if (std::abs(value) < threshold*colMax){
+	  continue;
+	}
+	const long markowitz = long(rows[i].size()-1)*(colCount[c]-1);
+	if (cost < 0 || markowitz < cost ||
+	    (markowitz == cost && std::abs(value) > std::abs(pivot))){
+	  cost = markowitz;
+	  pr = i;
+	  pc = c;
+	  pivot = value;
+	}
+      }
+    }
+    if (pr < 0){
+      // Singular matrix
+      for (int i=0; i<n; ++i){
+	answer.set(i,0,NAN);
+      }
+      return answer;
+    }
+    
+    // Remove pivot row from counts
+    activeRow[pr] = false;
+    activeCol[pc] = false;
+    pivots.push_back(std::make_pair(pr,pc));
+    for (const auto &entry:rows[pr]){
+      --colCount[entry.first];
+    }
+
+    // Elimination - Linear combination of rows
+    const SparseRow &prow = rows[pr];
+    for (const auto &i:colRows[pc]){
+      if (!activeRow[i]){
+	continue;
+      }
+      const double first = getSparse(rows[i],pc);
+      if (first == 0){
+	continue;
+      }
+      const double factor = first/pivot;
+      // Merge: rows[i] - factor*prow (pivot column removed)
+      merged.clear();
+      auto a = rows[i].begin();
+      auto b = prow.begin();
+      while (a != rows[i].end() || b != prow.end()){
+	if (b == prow.end() || (a != rows[i].end() && a->first < b->first)){
+	  if (a->first != pc){
+	    merged.push_back(*a);
+	  }
+	  ++a;
+	} else if (a == rows[i].end() || b->first < a->first){
+	  if (b->first != pc){
+	    // Fill-in
+	    merged.push_back(std::make_pair(b->first,-factor*b->second));
+	    colRows[b->first].push_back(i);
+	    ++colCount[b->first];
+	  }
+	  ++b;
+	} else{
+	  if (a->first != pc){
+	    merged.push_back(std::make_pair(a->first,a->second-factor*b->second));
+	  }
+	  ++a;
+	  ++b;
+	}
+      }
+      std::swap(rows[i],merged);
+      --colCount[pc];
+      rhs[i] -= factor*rhs[pr];
+    }
+  }
+
+  // Answer - Backward substitution in reverse pivot order
+  double aux, value;
+  for (int k=n-1; k>=0; --k){
+    const int r = pivots[k].first;
+    const int c = pivots[k].second;
+    aux = 0;
+    value = 0;
+    for (const auto &entry:rows[r]){
+      if (entry.first == c){
+	value = entry.second;
+      } else{
+	aux += entry.second*answer.get(entry.first,0);
+      }
+    }
+    answer.set(c,0,(rhs[r]-aux)/value);
+  }
+  return answer;
+}
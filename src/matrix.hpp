@@ -3,6 +3,8 @@
 
 #include <utility>
 #include <algorithm>
+#include <vector>
+#include <cmath>
 
 /**
  * Matrix struct
@@ -30,9 +32,39 @@ struct mat{
   mat& operator=(mat other);
 };
 
+/**
+ * Sparse matrix struct
+ * compressed rows (CSR) with sorted column indexes
+ */
+struct spmat{
+  spmat()=default;
+  spmat(int r, int c, const std::vector<std::vector<int>> &pattern);
+  // Data
+  int rows = 0;
+  int columns = 0;
+  std::vector<int> start;  // first entry of each row (rows+1)
+  std::vector<int> index;  // column of each entry
+  std::vector<double> values;
+};
+
+/**
+ * LU factorization with partial pivoting
+ * factored once and solved for many right-hand sides
+ * buffers are given by the caller: store (n*n) and perm (n)
+ */
+struct LU{
+  LU(int size, double* store, int* perm);
+  int n;
+  double* a;   // L (unit diagonal) and U factors
+  int* pivot;  // row swapped at each step
+  bool factor(const mat &coeff);
+  void solve(const double* b, double* x) const;
+};
+
 // mat functions
 void swapRow(mat& matrix,const int rowA,const int rowB);
 mat gaussElimination(mat& coeff, mat& equals);
+mat sparseElimination(const spmat& coeff, const mat& equals);
 
 #endif
 
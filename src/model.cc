@@ -0,0 +1,595 @@
+#include "model.hpp" // prototypes
+
+/**
+ * Model constructor
+ * the steps of solveProblem that don't need values: parse, fold constants,
+ * substitute simple equations and order the blocks
+ */
+Model::Model(const std::vector<std::string> &lines, const std::vector<std::string> &parameters){
+  // Parse lines
+  propsCache.clear(); // properties of a previous problem
+  clearBackends();
+  std::vector<Node*> equations;
+  for (const auto &line:lines){
+    if (isDirective(line)){
+      directive(line,hints);
+      directives.push_back(line);
+    } else{
+      Node* tree = parse(line,table);
+      equations.push_back(simplifyEquation(tree,table)); // constants only
+      release(tree);
+    }
+  }
+  applyHints(hints,table); // bounds and nominal values
+
+  // Parameters are known, their definitions are left out
+  for (const auto &name:parameters){
+    auto it = table.slots.find(name);
+    if (it == table.slots.end()){
+      throw std::invalid_argument("parameter not in model @Model");
+    }
+    this->parameters.push_back(it->second);
+    table.known[it->second] = 1;
+  }
+  for (unsigned i=0; i<equations.size(); ++i){
+    // parameter = expression without unknowns (other equations with a
+    // parameter alone on a side are constraints of the unknowns)
+    Node** sides = equations[i]->get_inputs();
+    bool definition = false;
+    for (int k=0; k<2 && equations[i]->get_op() == '-'; ++k){
+      definition = definition || (sides[k]->get_type() == 'v' && table.known[sides[k]->get_slot()] &&
+				  table.unknowns(sides[1-k]).empty());
+    }
+    if (definition){
+      release(equations[i]);
+      equations.erase(equations.begin()+i);
+      --i;
+    }
+  }
+
+  // Simple equations are solved after the others
+  std::vector<Node*> simple;
+  if (!equations.empty()){
+    simple = removeSimple(equations,table);
+    algebraicSubs(simple,equations,table);
+  }
+  inferBounds(equations,table); // from fluid limits
+  inferBounds(simple,table);
+
+  // Blocks: the variables of a block are known to the next ones
+  // the trees are compiled once, the values solved in earlier blocks are
+  // folded into the tapes of the workspace at each solve (Variables::fold)
+  for (auto group:{&equations,&simple}){
+    if (group->empty()){
+      continue;
+    }
+    for (auto &block:blockTriangular(*group,table)){
+      Variables* vars = new Variables(block,table);
+      if (hints.mode == SYMBOLIC){
+	vars->derive(); // nodes are only created here, never by the workers
+      }
+      for (int slot:vars->slots){
+	table.known[slot] = 1;
+      }
+      blocks.push_back(Block{block,vars});
+    }
+  }
+  std::fill(table.known.begin(),table.known.end(),0);
+  for (int slot:this->parameters){
+    table.known[slot] = 1;
+  }
+
+  // Dependencies between blocks (a DAG, earlier blocks come first)
+  std::vector<int> blockOf(table.names.size(),-1);
+  for (unsigned b=0; b<blocks.size(); ++b){
+    for (int slot:blocks[b].vars->slots){
+      blockOf[slot] = b;
+    }
+  }
+  after.assign(blocks.size(),std::vector<int>());
+  for (unsigned b=0; b<blocks.size(); ++b){
+    for (int slot:blocks[b].vars->inputs){
+      const int c = blockOf[slot];
+      if (c != -1 && c != (int)b &&
+	  (after[c].empty() || after[c].back() != (int)b)){
+	after[c].push_back(b);
+      }
+    }
+  }
+}
+
+/**
+ * Model destructor
+ */
+Model::~Model(){
+  for (auto &block:blocks){
+    delete block.vars;
+    for (auto &eq:block.equations){
+      release(eq);
+    }
+  }
+}
+
+/**
+ * Private values and tapes for solving (created by the owner thread)
+ */
+Model::Workspace Model::workspace() const{
+  Workspace work;
+  work.table = table;
+  work.vars.reserve(blocks.size());
+  for (const auto &block:blocks){
+    work.vars.push_back(*block.vars);
+  }
+  return work;
+}
+
+/**
+ * Solves the model for some parameters
+ * warm is a previous solution tried before the usual guesses, then the
+ * @guess values; a block without any of them starts with the usual guesses
+ * the model is not changed, the workspace holds the values
+ */
+void Model::solve(const Scope &inputs, Scope &solutions, Workspace &work, const Scope *warm) const{
+  VarTable &vtable = work.table;
+  std::fill(vtable.known.begin(),vtable.known.end(),0);
+
+  // Parameters
+  for (int slot:parameters){
+    auto it = inputs.find(vtable.names[slot]);
+    if (it == inputs.end()){
+      throw std::invalid_argument("parameter without value @Model::solve");
+    }
+    vtable.values[slot] = it->second;
+    vtable.known[slot] = 1;
+    solutions[it->first] = it->second;
+  }
+
+  // Blocks as soon as the blocks they use are solved
+  std::mutex lock;
+  runBlocks(after,[&](unsigned b){
+    const Block &block = blocks[b];
+    Variables &vars = work.vars[b];
+    Scope found; // solutions of this block
+    bool converged = false;
+    vars.fold(vtable.values.data()); // inputs of the block are known
+
+    // Previous solution, then @guess values (others start at 1)
+    mat start(vars.n,1);
+    unsigned given = 0;
+    unsigned i = 0;
+    for (const auto &name:vars.all){
+      start.set(i,0,1);
+      if (warm != nullptr && warm->count(name)){
+	start.set(i,0,warm->at(name));
+	++given;
+      } else if (hints.guesses.count(name)){
+	start.set(i,0,hints.guesses.at(name));
+	++given;
+      }
+      ++i;
+    }
+    if (given > 0){
+      converged = ::solve(vars,start,found,vtable,hints.mode);
+    }
+
+    // Try first Brent and after Newton
+    const unsigned max_count = 20;
+    for (unsigned i=0; i < max_count && !converged; ++i){
+      if (block.equations.size() == 1 && i == 0){
+	converged = ::solve(block.equations[0],found,vtable);
+      } else{
+	converged = ::solve(vars,found,vtable,i,hints.mode);
+      }
+      if (!converged){
+	// Clear guesses
+	for (int slot:vars.slots){
+	  found.erase(vtable.names[slot]);
+	  vtable.known[slot] = 0;
+	}
+      }
+    }
+    if (!converged){
+      throw std::invalid_argument("not converged @Model::solve");
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    solutions.insert(found.begin(),found.end());
+  });
+}
+
+/**
+ * Solves the model for some parameters with a new workspace
+ */
+Scope Model::solve(const Scope &inputs, const Scope *warm) const{
+  Workspace work = workspace();
+  Scope solutions;
+  solve(inputs,solutions,work,warm);
+  return solutions;
+}
+
+/**
+ * Names of the parameters
+ */
+std::vector<std::string> Model::inputs() const{
+  std::vector<std::string> out;
+  for (int slot:parameters){
+    out.push_back(table.names[slot]);
+  }
+  return out;
+}
+
+/**
+ * Compiled models
+ * a header (magic, version and byte order) followed by the directives,
+ * the variables, the parameters, the nodes of the equations in postfix
+ * order (a node refers to its inputs by index, shared nodes are written
+ * once) within the equations of each block and the DAG of the blocks
+ * PropsSI nodes keep their backend, @backend only applies to the calls
+ * after it in the text
+ */
+static const char modelMagic[8] = {'L','A','I','N','E','M','D','L'};
+static const uint32_t modelVersion = 2;
+static const uint32_t modelOrder = 0x01020304;
+
+/**
+ * Writes values to a compiled model
+ */
+struct ModelWriter{
+  std::ofstream file;
+  std::unordered_map<Node*,int> index; // node -> position
+  template<class T> void put(T value){
+    file.write(reinterpret_cast<const char*>(&value),sizeof(T));
+  }
+  void text(const std::string &word){
+    put<uint32_t>(word.size());
+    file.write(word.data(),word.size());
+  }
+  void count(uint32_t n){put<uint32_t>(n);}
+  void node(Node* tree);
+};
+
+/**
+ * Writes a node after its inputs
+ */
+void ModelWriter::node(Node* tree){
+  if (index.count(tree)){
+    return;
+  }
+  const int n = tree->get_n();
+  Node** inputs = tree->get_inputs();
+  for (int i=0; i<n; ++i){
+    node(inputs[i]);
+  }
+  const char type = tree->get_type();
+  put<char>(type);
+  switch (type){
+  case 'n':
+    put<double>(tree->eval(nullptr));
+    break;
+  case 'w':
+    text(tree->toString());
+    break;
+  case 'v':
+    put<int32_t>(tree->get_slot());
+    break;
+  case 'o':
+    put<char>(tree->get_op());
+    break;
+  case 'f':
+    text(funAlias(tree));
+    put<int32_t>(n);
+    if (dynamic_cast<NodePropsSI*>(tree) != nullptr){
+      // HEOS, or TTSE and BICUBIC for TTSE&HEOS and BICUBIC&HEOS
+      const std::string &backend = getFluid(static_cast<NodePropsSI*>(tree)->get_fluid()).backend;
+      const std::size_t tabular = backend.find('&');
+      text(tabular == std::string::npos ? "HEOS" : backend.substr(0,tabular));
+    }
+    break;
+  default:
+    throw std::invalid_argument("node type @Model::save");
+  }
+  for (int i=0; i<n; ++i){
+    put<int32_t>(index[inputs[i]]);
+  }
+  const int position = index.size();
+  index[tree] = position;
+}
+
+/**
+ * Saves the analyzed model, see load
+ */
+void Model::save(const std::string &filename) const{
+  ModelWriter out;
+  out.file.open(filename,std::ios::binary);
+  if (!out.file){
+    throw std::invalid_argument("file not opened @Model::save");
+  }
+  out.file.write(modelMagic,sizeof(modelMagic));
+  out.put<uint32_t>(modelVersion);
+  out.put<uint32_t>(modelOrder);
+  out.count(directives.size());
+  for (const auto &line:directives){
+    out.text(line);
+  }
+  out.count(table.names.size());
+  for (const auto &name:table.names){
+    out.text(name);
+  }
+  out.count(parameters.size());
+  for (int slot:parameters){
+    out.put<int32_t>(slot);
+  }
+
+  // Nodes are numbered as they are written, 'e' closes an equation
+  out.count(blocks.size());
+  for (const auto &block:blocks){
+    out.count(block.equations.size());
+    for (Node* eq:block.equations){
+      out.node(eq);
+      out.put<char>('e');
+      out.put<int32_t>(out.index[eq]);
+    }
+  }
+  for (const auto &list:after){
+    out.count(list.size());
+    for (int b:list){
+      out.put<int32_t>(b);
+    }
+  }
+  if (!out.file){
+    throw std::invalid_argument("file not written @Model::save");
+  }
+}
+
+/**
+ * Reads values from a mapped compiled model
+ */
+struct ModelReader{
+  const char* at;
+  const char* end;
+  template<class T> T get(){
+    if (end-at < (long)sizeof(T)){
+      throw std::invalid_argument("truncated file @Model::load");
+    }
+    T value;
+    std::memcpy(&value,at,sizeof(T));
+    at += sizeof(T);
+    return value;
+  }
+  std::string text(){
+    const uint32_t size = get<uint32_t>();
+    if ((unsigned long)(end-at) < size){
+      throw std::invalid_argument("truncated file @Model::load");
+    }
+    std::string word(at,size);
+    at += size;
+    return word;
+  }
+  int index(unsigned count){
+    const int32_t i = get<int32_t>();
+    if (i < 0 || i >= (int32_t)count){
+      throw std::invalid_argument("corrupt file @Model::load");
+    }
+    return i;
+  }
+};
+
+/**
+ * Inputs of a function: 'w' for a word, '#' for a value
+ */
+static std::string funShape(const std::string &alias){
+  if (alias == "PropsSI"){
+    return "ww#w#w";
+  } else if (alias == "HAPropsSI"){
+    return "ww#w#w#";
+  } else if (alias == "Props1SI"){
+    return "ww";
+  }
+  return "#";
+}
+
+/**
+ * Builds the next node of a compiled model from the nodes before it
+ */
+static Node* readNode(char type, ModelReader &in, const std::vector<Node*> &nodes,
+		      const VarTable &table){
+  switch (type){
+  case 'n':
+    return intern(new NodeDouble(in.get<double>()));
+  case 'w':
+    return intern(new NodeString(in.text()));
+  case 'v':{
+    const int slot = in.index(table.names.size());
+    return intern(new NodeVar(table.names[slot],slot));
+  }
+  case 'o':{
+    const char op = in.get<char>();
+    if (op != '+' && op != '-' && op != '*' && op != '/' && op != '^'){
+      throw std::invalid_argument("corrupt file @Model::load");
+    }
+    const int a = in.index(nodes.size());
+    const int b = in.index(nodes.size());
+    return intern(new NodeOp(op,share(nodes[a]),share(nodes[b])));
+  }
+  case 'f':{
+    const std::string alias = in.text();
+    const std::string shape = funShape(alias);
+    const int n = in.get<int32_t>();
+    if (n != (int)shape.size() || !isFunction(alias,n)){
+      throw std::invalid_argument("corrupt file @Model::load");
+    }
+    std::string backend;
+    if (alias == "PropsSI"){
+      backend = in.text();
+      if (backend != "HEOS" && backend != "TTSE" && backend != "BICUBIC"){
+	throw std::invalid_argument("corrupt file @Model::load");
+      }
+    }
+    Node* inputs[8];
+    for (int i=0; i<n; ++i){
+      inputs[i] = nodes[in.index(nodes.size())];
+      if ((inputs[i]->get_type() == 'w') != (shape[i] == 'w')){
+	throw std::invalid_argument("corrupt file @Model::load");
+      }
+    }
+    for (int i=0; i<n; ++i){
+      share(inputs[i]);
+    }
+    Node* tree;
+    if (alias == "PropsSI"){
+      setBackend(backend,""); // of this node
+      try{
+	tree = new NodePropsSI(alias,n,inputs); // releases its inputs if it throws
+      } catch (std::exception &e){
+	throw std::invalid_argument("corrupt file @Model::load");
+      }
+    } else{
+      tree = new NodeFun(alias,n,inputs);
+    }
+    return intern(tree);
+  }
+  default:
+    throw std::invalid_argument("corrupt file @Model::load");
+  }
+}
+
+/**
+ * Loads a model saved by save
+ * the file is mapped and read once: the nodes are rebuilt in postfix order
+ * and each block gets its tapes, nothing is parsed or ordered again
+ */
+Model* Model::load(const std::string &filename){
+  // Map the file
+  const int fd = open(filename.c_str(),O_RDONLY);
+  if (fd < 0){
+    throw std::invalid_argument("file not opened @Model::load");
+  }
+  struct stat info;
+  if (fstat(fd,&info) != 0 || info.st_size == 0){
+    close(fd);
+    throw std::invalid_argument("file not read @Model::load");
+  }
+  const size_t size = info.st_size;
+  void* data = mmap(nullptr,size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+  if (data == MAP_FAILED){
+    throw std::invalid_argument("file not mapped @Model::load");
+  }
+
+  ModelReader in{static_cast<const char*>(data),static_cast<const char*>(data)+size};
+  Model* model = new Model();
+  std::vector<Node*> nodes;
+  try{
+    // Header
+    if (size < sizeof(modelMagic) || std::memcmp(in.at,modelMagic,sizeof(modelMagic)) != 0){
+      throw std::invalid_argument("not a compiled model @Model::load");
+    }
+    in.at += sizeof(modelMagic);
+    if (in.get<uint32_t>() != modelVersion || in.get<uint32_t>() != modelOrder){
+      throw std::invalid_argument("model compiled by another version @Model::load");
+    }
+
+    // Directives, variables and parameters
+    propsCache.clear();
+    clearBackends();
+    for (uint32_t i=in.get<uint32_t>(); i>0; --i){
+      model->directives.push_back(in.text());
+      directive(model->directives.back(),model->hints);
+    }
+    VarTable &table = model->table;
+    for (uint32_t i=in.get<uint32_t>(); i>0; --i){
+      if (table.add(in.text()) != (int)table.names.size()-1){
+	throw std::invalid_argument("corrupt file @Model::load");
+      }
+    }
+    applyHints(model->hints,table);
+    for (uint32_t i=in.get<uint32_t>(); i>0; --i){
+      const int slot = in.index(table.names.size());
+      model->parameters.push_back(slot);
+      table.known[slot] = 1;
+    }
+
+    // Equations of the blocks
+    std::vector<Node*> all;
+    for (uint32_t b=in.get<uint32_t>(); b>0; --b){
+      std::vector<Node*> equations;
+      for (uint32_t i=in.get<uint32_t>(); i>0; --i){
+	char type;
+	while ((type = in.get<char>()) != 'e'){
+	  nodes.push_back(readNode(type,in,nodes,table));
+	}
+	equations.push_back(share(nodes[in.index(nodes.size())]));
+      }
+      model->blocks.push_back(Block{equations,nullptr});
+      all.insert(all.end(),equations.begin(),equations.end());
+    }
+    inferBounds(all,table); // from fluid limits
+
+    // Blocks: the variables of a block are known to the next ones
+    for (auto &block:model->blocks){
+      block.vars = new Variables(block.equations,table);
+      if (model->hints.mode == SYMBOLIC){
+	block.vars->derive();
+      }
+      for (int slot:block.vars->slots){
+	table.known[slot] = 1;
+      }
+    }
+    std::fill(table.known.begin(),table.known.end(),0);
+    for (int slot:model->parameters){
+      table.known[slot] = 1;
+    }
+
+    // Dependencies between blocks
+    const unsigned count = model->blocks.size();
+    model->after.assign(count,std::vector<int>());
+    for (unsigned b=0; b<count; ++b){
+      for (uint32_t i=in.get<uint32_t>(); i>0; --i){
+	model->after[b].push_back(in.index(count));
+      }
+    }
+    if (in.at != in.end){
+      throw std::invalid_argument("corrupt file @Model::load");
+    }
+  } catch (...){
+    for (Node* tree:nodes){
+      release(tree);
+    }
+    delete model;
+    munmap(data,size);
+    throw;
+  }
+  for (Node* tree:nodes){
+    release(tree);
+  }
+  munmap(data,size);
+  return model;
+}
+
+/**
+ * Checks the header of a compiled model
+ */
+bool isCompiled(const std::string &filename){
+  std::ifstream file(filename,std::ios::binary);
+  char magic[sizeof(modelMagic)] = {};
+  file.read(magic,sizeof(magic));
+  return file && std::memcmp(magic,modelMagic,sizeof(magic)) == 0;
+}
+
+/**
+ * Opens a text or compiled model
+ * a compiled model keeps the parameters it was compiled with
+ */
+Model* openModel(const std::string &filename, const std::vector<std::string> &parameters){
+  if (!isCompiled(filename)){
+    return new Model(getLinesFromFile(filename),parameters);
+  }
+  Model* model = Model::load(filename);
+  std::vector<std::string> given = parameters, compiled = model->inputs();
+  std::sort(given.begin(),given.end());
+  std::sort(compiled.begin(),compiled.end());
+  if (given != compiled){
+    delete model;
+    throw std::invalid_argument("parameters of the compiled model differ @openModel");
+  }
+  return model;
+}
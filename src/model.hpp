@@ -0,0 +1,58 @@
+#ifndef _MODEL_
+#define _MODEL_
+
+#include "reduce.hpp" // analysis of the problem
+#include <fstream>    // compiled models
+#include <cstring>    // file header
+#include <fcntl.h>    // open
+#include <unistd.h>   // close
+#include <sys/mman.h> // mapped files
+#include <sys/stat.h> // file size
+
+/**
+ * Model
+ * a problem parsed, reduced and ordered once, then solved for many inputs
+ * parameters are variables given at each solve, the equations that define
+ * them (parameter = expression) are left out
+ */
+class Model{
+  struct Block{
+    std::vector<Node*> equations; // owned
+    Variables* vars;              // tapes of the block
+  };
+  std::vector<std::string> directives; // applied again by load
+  Hints hints;                 // @guess, @bounds and @nominal values
+  VarTable table;              // parameters are the only known slots
+  std::vector<int> parameters; // slots
+  std::vector<Block> blocks;   // in solving order
+  std::vector<std::vector<int>> after; // blocks that use each block
+  Model()=default; // see load
+public:
+  /**
+   * Workspace
+   * values and tapes of one solve at a time (one per thread)
+   * the tapes read the trees of the model, which has to outlive it
+   */
+  struct Workspace{
+    VarTable table;
+    std::vector<Variables> vars;
+  };
+  Model(const std::vector<std::string> &lines,
+	const std::vector<std::string> &parameters=std::vector<std::string>());
+  ~Model();
+  Model(const Model &original)=delete;
+  const std::vector<std::string>& names() const {return table.names;}
+  std::vector<std::string> inputs() const;
+  void save(const std::string &filename) const;
+  static Model* load(const std::string &filename);
+  Workspace workspace() const;
+  void solve(const Scope &inputs, Scope &solutions, Workspace &work,
+	     const Scope *warm=nullptr) const;
+  Scope solve(const Scope &inputs, const Scope *warm=nullptr) const;
+};
+
+bool isCompiled(const std::string &filename);
+Model* openModel(const std::string &filename,
+		 const std::vector<std::string> &parameters=std::vector<std::string>());
+
+#endif // _MODEL_
@@ -4,7 +4,6 @@
 
 /**
  * TO-DO
- * Automatic prune nodes that can be computed
  * Add units, arrays and others
  * String variables could use the function toString to return the value, multiple scopes
  *
@@ -14,14 +13,218 @@
  */
 
 /**
- * NodeVar find variables
+ * VarTable add a name
+ * returns the slot of the variable, creating one if necessary
  */
-StringSet NodeVar::findVars(Scope &local){
-  StringSet names;
-  if (local.find(name) == local.end()){
-    names.insert(name);
+int VarTable::add(const std::string &name){
+  auto it = slots.find(name);
+  if (it != slots.end()){
+    return it->second;
   }
-  return names;
+  const int slot = names.size();
+  slots[name] = slot;
+  names.push_back(name);
+  values.push_back(0);
+  known.push_back(0);
+  lower.push_back(-INFINITY);
+  upper.push_back(INFINITY);
+  nominal.push_back(0);
+  return slot;
+}
+
+/**
+ * VarTable load values from a scope
+ */
+void VarTable::load(const Scope &local){
+  for (const auto &kv:local){
+    auto it = slots.find(kv.first);
+    if (it != slots.end()){
+      values[it->second] = kv.second;
+      known[it->second] = 1;
+    }
+  }
+}
+
+/**
+ * VarTable unknown slots of a tree (sorted)
+ */
+std::vector<int> VarTable::unknowns(Node* tree) const{
+  std::vector<int> out;
+  for (int slot:tree->get_slots()){
+    if (!known[slot]){
+      out.push_back(slot);
+    }
+  }
+  return out;
+}
+
+/**
+ * Node slots (none by default)
+ */
+const std::vector<int>& Node::get_slots(){
+  static const std::vector<int> none;
+  return none;
+}
+
+/**
+ * Unique nodes by shape (hash-consing)
+ */
+static std::unordered_multimap<size_t,Node*> uniques;
+
+/**
+ * Hash of the shape of a node: type, operation and inputs (which are unique)
+ */
+static size_t hashShape(Node* tree){
+  const char type = tree->get_type();
+  size_t h = std::hash<char>()(type);
+  auto mix = [&h](size_t v){h ^= v + 0x9e3779b97f4a7c15 + (h<<6) + (h>>2);};
+  switch (type){
+  case 'n':
+    mix(std::hash<double>()(tree->eval(nullptr)));
+    break;
+  case 'v':
+    mix(std::hash<int>()(tree->get_slot()));
+    break;
+  case 'w':
+    mix(std::hash<std::string>()(tree->toString()));
+    break;
+  default:
+    {
+      mix(std::hash<char>()(tree->get_op()));
+      Node** inputs = tree->get_inputs();
+      for (int i=0; i<tree->get_n(); ++i){
+	mix(std::hash<Node*>()(inputs[i]));
+      }
+      NodePropsSI* props = dynamic_cast<NodePropsSI*>(tree);
+      if (props != nullptr){
+	mix(std::hash<int>()(props->get_fluid())); // backend
+      }
+    }
+  }
+  return h;
+}
+
+/**
+ * Verifies if two nodes have the same shape
+ */
+static bool sameShape(Node* a, Node* b){
+  const char type = a->get_type();
+  if (type != b->get_type()){
+    return false;
+  }
+  switch (type){
+  case 'n':
+    return a->eval(nullptr) == b->eval(nullptr);
+  case 'v':
+    return a->get_slot() == b->get_slot() && a->toString() == b->toString();
+  case 'w':
+    return a->toString() == b->toString();
+  default:
+    {
+      const int n = a->get_n();
+      NodePropsSI* propsA = dynamic_cast<NodePropsSI*>(a);
+      NodePropsSI* propsB = dynamic_cast<NodePropsSI*>(b);
+      if (a->get_op() != b->get_op() || n != b->get_n() ||
+	  (propsA == nullptr) != (propsB == nullptr) ||
+	  (propsA != nullptr && !propsA->sameCall(*propsB))){
+	return false;
+      }
+      return std::equal(a->get_inputs(),a->get_inputs()+n,b->get_inputs());
+    }
+  }
+}
+
+/**
+ * Adds an owner to a node
+ */
+Node* share(Node* tree){
+  ++tree->refs;
+  return tree;
+}
+
+/**
+ * Removes an owner of a node, deleting it if it was the last one
+ */
+void release(Node* tree){
+  if (tree == nullptr || --tree->refs > 0){
+    return;
+  }
+  auto range = uniques.equal_range(hashShape(tree));
+  for (auto it = range.first; it != range.second; ++it){
+    if (it->second == tree){
+      uniques.erase(it);
+      break;
+    }
+  }
+  delete tree;
+}
+
+/**
+ * Returns the unique node with the shape of tree
+ * tree is released if an equal node already exists
+ */
+Node* intern(Node* tree){
+  const size_t h = hashShape(tree);
+  auto range = uniques.equal_range(h);
+  for (auto it = range.first; it != range.second; ++it){
+    if (sameShape(it->second,tree)){
+      Node* same = share(it->second);
+      release(tree);
+      return same;
+    }
+  }
+  uniques.emplace(h,tree);
+  return tree;
+}
+
+/**
+ * Number node
+ */
+static Node* number(double value){
+  return intern(new NodeDouble(value));
+}
+
+/**
+ * Node with other inputs (leaves are shared)
+ */
+Node* Node::rebuild(Node** in){
+  return share(this);
+}
+
+/**
+ * Replaces a variable by a tree
+ * subtrees without the variable are shared, each node is visited once
+ */
+static Node* substitute(Node* tree, int slot, Node* value, std::unordered_map<Node*,Node*> &done){
+  const std::vector<int> &slots = tree->get_slots();
+  if (!std::binary_search(slots.begin(),slots.end(),slot)){
+    return share(tree);
+  } else if (tree->get_type() == 'v'){
+    return share(value);
+  }
+  auto it = done.find(tree);
+  if (it != done.end()){
+    return share(it->second);
+  }
+  const int n = tree->get_n();
+  Node** inputs = tree->get_inputs();
+  std::vector<Node*> in(n);
+  for (int i=0; i<n; ++i){
+    in[i] = substitute(inputs[i],slot,value,done);
+  }
+  Node* out = intern(tree->rebuild(in.data()));
+  if (tree->refs > 1){
+    done[tree] = out; // only shared nodes are visited again
+  }
+  return out;
+}
+
+/**
+ * Replaces a variable by a tree, returns a new reference
+ */
+Node* substitute(Node* tree, int slot, Node* value){
+  std::unordered_map<Node*,Node*> done;
+  return substitute(tree,slot,value,done);
 }
 
 /**
@@ -38,14 +241,214 @@ std::map<unsigned char,std::string> namesOne =
   {
    {0,"exp"},{1,"log"},{2,"log10"},{3,"fabs"},{4,"cos"},
    {5,"sin"},{6,"tan"},{7,"sqrt"},{8,"acos"},{9,"asin"},
-   {10,"atan"},{11,"cosh"},{12,"sinh"},{13,"tanh"}
+   {10,"atan"},{11,"cosh"},{12,"sinh"},{13,"tanh"},{14,"sign"}
   };
 
+/**
+ * Functions the text can't call (not in funsOne), see NodeFun::derive
+ */
+static const unsigned char signCode = 14; // derivative of fabs, 0 at 0
+
+/**
+ * Node derivative
+ * constants, words and unknown nodes have zero derivative
+ */
+Node* Node::derive(int slot){
+  return number(0);
+}
+
+/**
+ * Verifies if a tree is a given number
+ */
+bool isValue(Node* tree, double value){
+  return tree->get_type() == 'n' && tree->eval(nullptr) == value;
+}
+
+/**
+ * Evaluates an operation
+ */
+double evalOp(const double left,const double right,const char op){
+  switch (op) {
+  case '+':
+    return left+right;
+  case '-':
+    return left-right;
+  case '*':
+    return left*right;
+  case '/':
+    return left/right;
+  case '^':
+    return pow(left,right);
+  default:
+    throw std::invalid_argument("op @evalOp");
+  }
+  return 0;
+}
+
+/**
+ * Builds an operation node with basic simplifications
+ * a and b are owned by the new tree (or released)
+ */
+Node* makeOp(char op, Node* a, Node* b){
+  // Fold numbers
+  if (a->get_type() == 'n' && b->get_type() == 'n'){
+    double value = evalOp(a->eval(nullptr),b->eval(nullptr),op);
+    release(a);
+    release(b);
+    return number(value);
+  }
+  // Identities
+  Node* keep = nullptr;
+  switch (op){
+  case '+':
+    keep = isValue(a,0) ? b : (isValue(b,0) ? a : nullptr);
+    break;
+  case '-':
+    keep = isValue(b,0) ? a : nullptr;
+    break;
+  case '*':
+    if (isValue(a,0) || isValue(b,0)){
+      release(a);
+      release(b);
+      return number(0);
+    }
+    keep = isValue(a,1) ? b : (isValue(b,1) ? a : nullptr);
+    break;
+  case '/':
+    keep = isValue(a,0) || isValue(b,1) ? a : nullptr;
+    break;
+  case '^':
+    if (isValue(b,0)){
+      release(a);
+      release(b);
+      return number(1);
+    }
+    keep = isValue(b,1) ? a : nullptr;
+    // Small integer exponents (a is evaluated once in the tape)
+    if (isValue(b,2)){
+      release(b);
+      return makeOp('*',share(a),a);
+    } else if (isValue(b,3)){
+      release(b);
+      return makeOp('*',makeOp('*',share(a),share(a)),a);
+    } else if (isValue(b,-1)){
+      release(b);
+      return makeOp('/',number(1),a);
+    }
+    break;
+  }
+  if (keep != nullptr){
+    release(keep == a ? b : a);
+    return keep;
+  }
+  return intern(new NodeOp(op,a,b));
+}
+
+/**
+ * Builds a function node of one input
+ */
+Node* makeFun(std::string alias, Node* a){
+  return makeFun(funsOne.at(alias),a);
+}
+
+/**
+ * Builds a function node of one input from its code
+ */
+Node* makeFun(unsigned char code, Node* a){
+  if (a->get_type() == 'n'){
+    double value = evalFunOne(code,a->eval(nullptr));
+    release(a);
+    return number(value);
+  }
+  Node* inputs[1] = {a};
+  return intern(new NodeFun(code,1,inputs));
+}
+
+/**
+ * Folds constants and known variables of a tree, each node is visited once
+ */
+static Node* simplify(Node* tree, const VarTable &table, std::unordered_map<Node*,Node*> &done){
+  const char type = tree->get_type();
+  if (type == 'v'){
+    const int slot = tree->get_slot();
+    return table.known[slot] ? number(table.values[slot]) : share(tree);
+  } else if (type != 'o' && type != 'f'){
+    return share(tree);
+  }
+  auto it = done.find(tree);
+  if (it != done.end()){
+    return share(it->second);
+  }
+  const int n = tree->get_n();
+  Node** inputs = tree->get_inputs();
+  std::vector<Node*> in(n);
+  bool constant = true;
+  for (int i=0; i<n; ++i){
+    in[i] = simplify(inputs[i],table,done);
+    constant = constant && in[i]->get_slots().empty();
+  }
+  Node* out;
+  if (type == 'o'){
+    out = makeOp(tree->get_op(),in[0],in[1]);
+  } else if (n == 1){
+    out = makeFun(tree->get_op(),in[0]);
+  } else{
+    // Functions of several inputs (CoolProp) are computed once if constant
+    out = intern(tree->rebuild(in.data()));
+    if (constant){
+      const double value = out->eval(nullptr);
+      release(out);
+      out = number(value);
+    }
+  }
+  if (tree->refs > 1){
+    done[tree] = share(out); // only shared nodes are visited again
+  }
+  return out;
+}
+
+/**
+ * Folds constants and known variables, returns a new reference
+ * identities are removed and small powers are replaced by products
+ */
+Node* simplify(Node* tree, const VarTable &table){
+  std::unordered_map<Node*,Node*> done; // keeps a reference of each result
+  Node* out = simplify(tree,table,done);
+  for (auto &kv:done){
+    release(kv.second);
+  }
+  return out;
+}
+
+/**
+ * Folds the sides of an equation (lhs - rhs), the root is always kept
+ * since the sides are read apart (Tape::evalSides, simple)
+ */
+Node* simplifyEquation(Node* tree, const VarTable &table){
+  if (tree->get_type() != 'o' || tree->get_op() != '-'){
+    return simplify(tree,table);
+  }
+  std::unordered_map<Node*,Node*> done;
+  Node** sides = tree->get_inputs();
+  Node* lhs = simplify(sides[0],table,done);
+  Node* rhs = simplify(sides[1],table,done);
+  for (auto &kv:done){
+    release(kv.second);
+  }
+  return intern(new NodeOp('-',lhs,rhs));
+}
+
+/**
+ * NodeVar derivative
+ */
+Node* NodeVar::derive(int var){
+  return number(var == slot ? 1 : 0);
+}
+
 /**
  * Evaluates a function
  */
-double evalFunOne(const unsigned char code,Node** input,Scope &local){
-  double value = input[0] -> eval(local);
+double evalFunOne(const unsigned char code,const double value){
   double ans;
   switch (code){
   case 0:
@@ -90,12 +493,72 @@ double evalFunOne(const unsigned char code,Node** input,Scope &local){
   case 13:
     ans = tanh(value);
     break;
+  case 14:
+    ans = value > 0 ? 1 : (value < 0 ? -1 : 0);
+    break;
   default:
     throw std::invalid_argument("code @evalFunOne");
   }
   return ans;
 }
 
+/**
+ * Derivative of a function
+ */
+double diffFunOne(const unsigned char code,const double value){
+  double ans;
+  switch (code){
+  case 0:
+    ans = exp(value);
+    break;
+  case 1:
+    ans = 1/value;
+    break;
+  case 2:
+    ans = 1/(value*log(10));
+    break;
+  case 3:
+    ans = value > 0 ? 1 : (value < 0 ? -1 : 0);
+    break;
+  case 4:
+    ans = -sin(value);
+    break;
+  case 5:
+    ans = cos(value);
+    break;
+  case 6:
+    ans = 1/pow(cos(value),2);
+    break;
+  case 7:
+    ans = 0.5/sqrt(value);
+    break;
+  case 8:
+    ans = -1/sqrt(1-value*value);
+    break;
+  case 9:
+    ans = 1/sqrt(1-value*value);
+    break;
+  case 10:
+    ans = 1/(1+value*value);
+    break;
+  case 11:
+    ans = sinh(value);
+    break;
+  case 12:
+    ans = cosh(value);
+    break;
+  case 13:
+    ans = 1-pow(tanh(value),2);
+    break;
+  case 14:
+    ans = 0;
+    break;
+  default:
+    throw std::invalid_argument("code @diffFunOne");
+  }
+  return ans;
+}
+
 /**
  * Functions with multiples inputs
  */
@@ -110,19 +573,40 @@ std::map<unsigned char,std::string> namesMore =
    {0,"HAPropsSI"},{1,"Props1SI"}
   };
 
-double evalFunMore(const unsigned char code, Node** input, Scope &local){
+/**
+ * Verifies if a name is a function of n inputs (the maps are not changed)
+ */
+bool isFunction(const std::string &alias, int n){
+  if (alias == "PropsSI"){
+    return n == 6;
+  } else if (n == 1){
+    return funsOne.find(alias) != funsOne.end();
+  }
+  return funsMore.find(alias) != funsMore.end();
+}
+
+/**
+ * Evaluates a function with multiple inputs
+ * args are the numeric inputs, words are taken from the nodes
+ */
+double evalFunMore(const unsigned char code, Node** input, const double* args){
   double ans;
   switch (code){
   case 0:
     {
       std::string p = input[0]->toString();
       std::string v1 = input[1]->toString();
-      double n1 = input[2] -> eval(local);
+      double n1 = args[0];
       std::string v2 = input[3]->toString();
-      double n2 = input[4] -> eval(local);
+      double n2 = args[1];
       std::string v3 = input[5]->toString();
-      double n3 = input[6] -> eval(local);
-      ans = HumidAir::HAPropsSI(p,v1,n1,v2,n2,v3,n3);
+      double n3 = args[2];
+      const std::string key = "HAPropsSI|"+p+'|'+v1+'|'+v2+'|'+v3;
+      if (!propsCache.find(key,args,3,ans)){
+	std::lock_guard<std::mutex> guard(frontLock);
+	ans = HumidAir::HAPropsSI(p,v1,n1,v2,n2,v3,n3);
+	propsCache.store(key,args,3,ans);
+      }
       // OBS: CoolProp library is compiled without error report
     }
     break;
@@ -130,6 +614,7 @@ double evalFunMore(const unsigned char code, Node** input, Scope &local){
     {
       std::string p = input[0]->toString();
       std::string fluid = input[1]->toString();
+      std::lock_guard<std::mutex> guard(frontLock);
       ans = CoolProp::Props1SI(p,fluid);
       // OBS: CoolProp library is compiled without error report
     }
@@ -143,9 +628,15 @@ double evalFunMore(const unsigned char code, Node** input, Scope &local){
 /**
  * NodeFun constructor
  */
-NodeFun::NodeFun(std::string alias, int number, Node** var){
+NodeFun::NodeFun(std::string alias, int number, Node** var):
+  NodeFun(number == 1 ? funsOne[alias] : funsMore[alias],number,var){}
+
+/**
+ * NodeFun constructor from the code of the function
+ */
+NodeFun::NodeFun(unsigned char code, int number, Node** var){
   n = number;
-  op = n == 1 ? funsOne[alias] : funsMore[alias];
+  op = code;
   inputs = new Node*[n];
   for (int i=0; i<n; ++i){
     inputs[i] = var[i];
@@ -158,7 +649,7 @@ NodeFun::NodeFun(std::string alias, int number, Node** var){
 NodeFun::~NodeFun(){
   int n = get_n();
   for (int i=0;i<n;++i){
-    delete inputs[i];
+    release(inputs[i]);
   }
   delete[] inputs;
 }
@@ -166,27 +657,142 @@ NodeFun::~NodeFun(){
 /**
  * NodeFun eval
  */
-double NodeFun::eval(Scope &local){
+double NodeFun::eval(const double* x){
   if (n==1){
-    return evalFunOne(op,inputs,local);
+    return evalFunOne(op,inputs[0]->eval(x));
   } else{
-    //return 0;
-    return evalFunMore(op,inputs,local);
+    // Numeric inputs only
+    std::vector<double> args;
+    for (int i=0; i<n; ++i){
+      if (inputs[i]->get_type() != 'w'){
+	args.push_back(inputs[i]->eval(x));
+      }
+    }
+    return call(args.data());
+  }
+}
+
+/**
+ * NodeFun call with evaluated numeric inputs
+ */
+double NodeFun::call(const double* args){
+  if (n==1){
+    return evalFunOne(op,args[0]);
+  } else{
+    return evalFunMore(op,inputs,args);
   }
 }
 
 
 /**
- * NodeFun find vars
+ * NodeFun partial derivative of call with respect to args[k]
+ * y is the value of call(args), args are restored
  */
-StringSet NodeFun::findVars(Scope &local){
-  StringSet names;
-  std::set<std::string> dummy;
-  for (int i=0;i<n;++i){
-    dummy = inputs[i] -> findVars(local);
-    names.insert(dummy.begin(),dummy.end());
+double NodeFun::partial(double* args, int k, double y){
+  const double rdiff = 1e-8;
+  const double a = args[k];
+  const double da = a==0 ? rdiff : a*rdiff; // avoid zero difference
+  args[k] = a+da;
+  double dy = call(args);
+  args[k] = a;
+  return (dy-y)/da;
+}
+
+/**
+ * NodeFun derivative
+ * chain rule for functions of one input, functions with several inputs
+ * can't be derived (nullptr) unless they don't depend on the variable
+ */
+Node* NodeFun::derive(int slot){
+  if (n != 1){
+    for (int i=0; i<n; ++i){
+      Node* d = inputs[i]->derive(slot);
+      const bool zero = d != nullptr && isValue(d,0);
+      if (d != nullptr){
+	release(d);
+      }
+      if (!zero){
+	return nullptr;
+      }
+    }
+    return number(0);
   }
-  return names;
+  Node* du = inputs[0]->derive(slot);
+  if (du == nullptr || isValue(du,0)){
+    return du;
+  }
+  Node* u = inputs[0];
+  Node* df;
+  switch (op){
+  case 0: // exp(u)
+    df = makeFun("exp",share(u));
+    break;
+  case 1: // 1/u
+    df = makeOp('/',number(1),share(u));
+    break;
+  case 2: // 1/(u*log(10))
+    df = makeOp('/',number(1),makeOp('*',share(u),number(log(10))));
+    break;
+  case 3: // sign(u), 0 at 0 as diffFunOne
+    df = makeFun(signCode,share(u));
+    break;
+  case 4: // -sin(u)
+    df = makeOp('-',number(0),makeFun("sin",share(u)));
+    break;
+  case 5: // cos(u)
+    df = makeFun("cos",share(u));
+    break;
+  case 6: // 1/cos(u)^2
+    df = makeOp('/',number(1),makeOp('^',makeFun("cos",share(u)),number(2)));
+    break;
+  case 7: // 0.5/sqrt(u)
+    df = makeOp('/',number(0.5),makeFun("sqrt",share(u)));
+    break;
+  case 8: // -1/sqrt(1-u^2)
+  case 9: // 1/sqrt(1-u^2)
+    df = makeOp('/',number(op == 8 ? -1 : 1),
+		makeFun("sqrt",makeOp('-',number(1),makeOp('^',share(u),number(2)))));
+    break;
+  case 10: // 1/(1+u^2)
+    df = makeOp('/',number(1),makeOp('+',number(1),makeOp('^',share(u),number(2))));
+    break;
+  case 11: // sinh(u)
+    df = makeFun("sinh",share(u));
+    break;
+  case 12: // cosh(u)
+    df = makeFun("cosh",share(u));
+    break;
+  case 13: // 1-tanh(u)^2
+    df = makeOp('-',number(1),makeOp('^',makeFun("tanh",share(u)),number(2)));
+    break;
+  case signCode: // 0
+    release(du);
+    return number(0);
+  default:
+    release(du);
+    throw std::invalid_argument("code @NodeFun::derive");
+  }
+  return makeOp('*',df,du);
+}
+
+/**
+ * NodeFun slots of the variables
+ * computed once, nodes don't change
+ */
+const std::vector<int>& NodeFun::get_slots(){
+  if (stale){
+    incidence.clear();
+    std::vector<int> merged;
+    for (int i=0;i<n;++i){
+      const std::vector<int> &child = inputs[i] -> get_slots();
+      merged.clear();
+      std::set_union(incidence.begin(),incidence.end(),child.begin(),child.end(),
+		     std::back_inserter(merged));
+      incidence.swap(merged);
+    }
+    stale = false;
+  }
+  return incidence;
 }
 
 /**
@@ -206,32 +812,20 @@ std::string NodeFun::toString(){
 }
 
 /**
- * NodeFun copy
+ * NodeFun with other inputs (owned by the new node)
  */
-NodeFun* NodeFun::get_copy(){
-  Node** copy_inputs = new Node*[n];
-  for (int i=0;i<n;++i){
-    copy_inputs[i] = inputs[i]->get_copy();
-  }
-  std::string alias = n == 1 ? namesOne[op] : namesMore[op];
-  return new NodeFun(alias, n, copy_inputs);
+NodeFun* NodeFun::rebuild(Node** in){
+  return new NodeFun(op, n, in);
 }
 
 /**
- * NodeFun swap variables
+ * Name of the function of a node, as written in the text
  */
-void NodeFun::swap_var(std::string var, Node* tree){
-  for (int i = 0; i<n ; ++i){
-    char type = inputs[i] ->get_type();
-    if (type == 'v' && inputs[i]->toString() == var){
-      // Create a copy, swap and delete old;
-      Node* copy = tree ->get_copy();
-      std::swap(inputs[i],copy);
-      delete copy;
-    } else if (type == 'o' || type == 'f'){
-      inputs[i] -> swap_var(var,tree);
-    }
+std::string funAlias(Node* tree){
+  if (dynamic_cast<NodePropsSI*>(tree) != nullptr){
+    return "PropsSI";
   }
+  return tree->get_n() == 1 ? namesOne[tree->get_op()] : namesMore[tree->get_op()];
 }
 
 /**
@@ -248,9 +842,9 @@ NodeOp::NodeOp(char symbol, Node* a, Node* b){
 /**
  * NodeOp eval
  */
-double NodeOp::eval(Scope &local){
-  double n1 = inputs[0] -> eval(local);
-  double n2 = inputs[1] -> eval(local);
+double NodeOp::eval(const double* x){
+  double n1 = inputs[0] -> eval(x);
+  double n2 = inputs[1] -> eval(x);
   switch (op) {
   case '+':
     return n1+n2;
@@ -268,6 +862,48 @@ double NodeOp::eval(Scope &local){
   return 0;
 }
 
+/**
+ * NodeOp derivative
+ */
+Node* NodeOp::derive(int slot){
+  Node* da = inputs[0]->derive(slot);
+  Node* db = inputs[1]->derive(slot);
+  if (da == nullptr || db == nullptr){
+    if (da != nullptr){
+      release(da);
+    }
+    if (db != nullptr){
+      release(db);
+    }
+    return nullptr;
+  }
+  Node* a = inputs[0];
+  Node* b = inputs[1];
+  switch (op){
+  case '+':
+  case '-':
+    return makeOp(op,da,db);
+  case '*': // da*b + a*db
+    return makeOp('+',makeOp('*',da,share(b)),makeOp('*',share(a),db));
+  case '/': // (da*b - a*db)/b^2
+    return makeOp('/',makeOp('-',makeOp('*',da,share(b)),makeOp('*',share(a),db)),
+		  makeOp('^',share(b),number(2)));
+  case '^':
+    if (isValue(db,0)){
+      // b*a^(b-1)*da
+      release(db);
+      return makeOp('*',makeOp('*',share(b),makeOp('^',share(a),makeOp('-',share(b),number(1)))),da);
+    } else{
+      // a^b*(db*log(a) + b*da/a)
+      return makeOp('*',share(this),makeOp('+',makeOp('*',db,makeFun("log",share(a))),
+					   makeOp('/',makeOp('*',share(b),da),share(a))));
+    }
+  default:
+    throw std::invalid_argument("op @NodeOp::derive");
+  }
+  return nullptr;
+}
+
 /**
  * NodeFun give string
  */
@@ -281,93 +917,171 @@ std::string NodeOp::toString(){
 }
 
 /**
- * NodeOp copy
+ * NodeOp with other inputs
  */
-NodeOp* NodeOp::get_copy(){
-  Node* left = inputs[0]->get_copy();
-  Node* right = inputs[1]->get_copy();
-  return new NodeOp(op,left,right);
+NodeOp* NodeOp::rebuild(Node** in){
+  return new NodeOp(op,in[0],in[1]);
 }
 
 /**
  * Node CoolProp
+ * keys, input pair and fluid are resolved once, at parse time
  */
 NodePropsSI::NodePropsSI(std::string alias, int number, Node** var){
-  // Copied from NodeFun
+  // Copied from NodeFun, CoolProp is called directly (no code of evalFunMore)
   n = number;
-  op = n == 1 ? funsOne[alias] : funsMore[alias];
+  op = 0;
   inputs = new Node*[n];
   for (int i=0; i<n; ++i){
     inputs[i] = var[i];
   }
+  if (n != 6){
+    throw std::invalid_argument("inputs @NodePropsSI"); // released with the node
+  }
 
-  // To reduce computational time required for checks
+  // CoolProp keys, trivial outputs (Tcrit, M, ...) don't need a state
+  std::string p = inputs[0]->toString();
   std::string v1 = inputs[1]->toString();
   std::string v2 = inputs[3]->toString();
-  std::string fluid = inputs[5]->toString();
-  if (v1 == "Q" || v2 == "Q"){
-    TMAX = CoolProp::PropsSI("TCRIT","",0,"",0,fluid);
-    PMAX = CoolProp::PropsSI("PCRIT","",0,"",0,fluid);
+  std::string name = inputs[5]->toString();
+  if (!CoolProp::is_valid_parameter(p,output)){
+    throw std::invalid_argument("key @NodePropsSI");
+  }
+  trivial = CoolProp::is_trivial_parameter(output);
+  keys[0] = keys[1] = CoolProp::INVALID_PARAMETER;
+  pair = CoolProp::INPUT_PAIR_INVALID;
+  swap = false;
+  if (!trivial && (!CoolProp::is_valid_parameter(v1,keys[0]) ||
+		   !CoolProp::is_valid_parameter(v2,keys[1]))){
+    throw std::invalid_argument("key @NodePropsSI");
+  } else if (!trivial){
+    double in1, in2; // the pair tells the order of its values
+    pair = CoolProp::generate_update_pair(keys[0],1.0,keys[1],2.0,in1,in2);
+    swap = in1 == 2.0;
+  }
+  const CoolProp::parameters key1 = keys[0], key2 = keys[1];
+  first = key1 == CoolProp::iT ? 'T' : key1 == CoolProp::iP ? 'P' : 0;
+  second = key2 == CoolProp::iT ? 'T' : key2 == CoolProp::iP ? 'P' : 0;
+
+  // Limits are shared by every node of the fluid
+  try{
+    fluid = findFluid(name);
+  } catch (std::exception &e){
+    throw std::invalid_argument("fluid @NodePropsSI");
+  }
+  const Fluid &info = getFluid(fluid);
+  key = "PropsSI|"+p+'|'+v1+'|'+v2+'|'+info.backend+"::"+info.name;
+  if (key1 == CoolProp::iQ || key2 == CoolProp::iQ){
+    TMAX = info.Tcrit;
+    PMAX = info.Pcrit;
   } else {
-    TMAX = CoolProp::PropsSI("TMAX","",0,"",0,fluid);
-    PMAX = CoolProp::PropsSI("PMAX","",0,"",0,fluid);
+    TMAX = info.Tmax;
+    PMAX = info.Pmax;
   }
-  TMIN = CoolProp::PropsSI("TMIN","",0,"",0,fluid);
-  PMIN = CoolProp::PropsSI("PMIN","",0,"",0,fluid);
+  TMIN = info.Tmin;
+  PMIN = info.Pmin;
 }
 
-NodePropsSI::NodePropsSI(Node** in, double Tmax, double Pmax, double Tmin, double Pmin){
+NodePropsSI::NodePropsSI(Node** in, const NodePropsSI &other){
   // Copied from NodeFun
-  n = 6;
-  op = 0;
+  n = other.n;
+  op = other.op;
   inputs = new Node*[n];
   for (int i=0; i<n; ++i){
     inputs[i] = in[i];
   }
 
   // To avoid recalculations
-  TMAX = Tmax;
-  PMAX = Pmax;
-  TMIN = Tmin;
-  PMIN = Pmin;
+  TMAX = other.TMAX;
+  PMAX = other.PMAX;
+  TMIN = other.TMIN;
+  PMIN = other.PMIN;
+  fluid = other.fluid;
+  output = other.output;
+  keys[0] = other.keys[0];
+  keys[1] = other.keys[1];
+  pair = other.pair;
+  swap = other.swap;
+  trivial = other.trivial;
+  first = other.first;
+  second = other.second;
+  key = other.key;
 }
 
-double NodePropsSI::eval(Scope &local){
-  // Get data
-  std::string p = inputs[0]->toString();
-  std::string v1 = inputs[1]->toString();
-  double n1 = inputs[2] -> eval(local);
-  std::string v2 = inputs[3]->toString();
-  double n2 = inputs[4] -> eval(local);
-  std::string fluid = inputs[5]->toString();
+/**
+ * Verifies if two nodes call CoolProp with the same keys and fluid state
+ * (the same words give other states after a @backend directive)
+ */
+bool NodePropsSI::sameCall(const NodePropsSI &other) const{
+  return fluid == other.fluid && output == other.output &&
+    keys[0] == other.keys[0] && keys[1] == other.keys[1];
+}
+
+/**
+ * Verifies the temperature and pressure limits of an input
+ */
+static inline bool outside(char kind, double value, double Tmax, double Pmax, double Tmin, double Pmin){
+  if (kind == 'T'){
+    return value >= Tmax || value <= Tmin;
+  } else if (kind == 'P'){
+    return value >= Pmax || value <= Pmin;
+  }
+  return false;
+}
 
+/**
+ * Open range of the k-th input (0 or 1) where call is not NAN
+ * false if the input is not limited (see call)
+ */
+bool NodePropsSI::limits(int k, double &lower, double &upper) const{
+  const char kind = k == 0 ? first : second;
+  if (first != 'T' && second != 'T'){
+    return false;
+  } else if (kind == 'T'){
+    lower = TMIN;
+    upper = TMAX;
+  } else if (kind == 'P'){
+    lower = PMIN;
+    upper = PMAX;
+  } else{
+    return false;
+  }
+  return std::isfinite(lower) && std::isfinite(upper) && lower < upper;
+}
+
+double NodePropsSI::call(const double* args){
   // Valid values
-  if (!std::isfinite(n1) || !std::isfinite(n2)){
+  if (!std::isfinite(args[0]) || !std::isfinite(args[1])){
     return NAN;
   }
   
-  //CoolProp::set_config_bool(DONT_CHECK_PROPERTY_LIMITS,true);
-  // Check temperature and pressure limits
-  // Temperature and pressure limits
-  if (v1 == "T"){
-    if (n1 >= TMAX || n1 <= TMIN){
+  // Temperature and pressure limits (pressure is checked only with temperature)
+  if (first == 'T' || second == 'T'){
+    if (outside(first,args[0],TMAX,PMAX,TMIN,PMIN) ||
+	outside(second,args[1],TMAX,PMAX,TMIN,PMIN)){
       return NAN;
-    } else if (v2 == "P"){
-      if (n2 >= PMAX || n2 <= PMIN){
-	return NAN;
-      }
     }
-  } else if (v2 == "T"){
-    if (n2 >= TMAX || n2 <= TMIN){
+  }
+
+  // Quality, CoolProp throws outside [0,1] (an abort in wasm)
+  for (int k=0; k<2 && !trivial; ++k){
+    if (keys[k] == CoolProp::iQ && (args[k] < 0 || args[k] > 1)){
       return NAN;
-    } else if (v1 == "P"){
-      if (n1 >= PMAX || n1 <= PMIN){
-	return NAN;
-      }
     }
   }
 
-  double ans = CoolProp::PropsSI(p,v1,n1,v2,n2,fluid);
+  // Repeated inputs are computed once per problem
+  double ans;
+  if (!propsCache.find(key,args,2,ans)){
+    if (trivial){
+      ans = fluidOutput(fluid,output);
+    } else{
+      ans = swap ?
+	fluidOutput(fluid,output,pair,args[1],args[0]) :
+	fluidOutput(fluid,output,pair,args[0],args[1]);
+    }
+    propsCache.store(key,args,2,ans);
+  }
 
   if (std::isinf(ans)){
     return NAN;
@@ -377,13 +1091,27 @@ double NodePropsSI::eval(Scope &local){
 }
 
 /**
- * NodeFun copy
+ * NodePropsSI partial derivative
+ * analytic from CoolProp at the same state, finite difference if it fails
  */
-NodePropsSI* NodePropsSI::get_copy(){
-  Node** copy_inputs = new Node*[n];
-  for (int i=0;i<n;++i){
-    copy_inputs[i] = inputs[i]->get_copy();
+double NodePropsSI::partial(double* args, int k, double y){
+  if (std::isnan(y)){
+    return NAN;
+  } else if (trivial){
+    return 0; // constant of the fluid
+  }
+  const double d = swap ?
+    fluidPartial(fluid,output,keys[k],keys[1-k],pair,args[1],args[0]) :
+    fluidPartial(fluid,output,keys[k],keys[1-k],pair,args[0],args[1]);
+  if (std::isfinite(d)){
+    return d;
   }
-  std::string alias = n == 1 ? namesOne[op] : namesMore[op];
-  return new NodePropsSI(copy_inputs, TMAX, PMAX, TMIN, PMIN);
+  return NodeFun::partial(args,k,y);
+}
+
+/**
+ * NodePropsSI with other inputs (resolved keys and limits are kept)
+ */
+NodePropsSI* NodePropsSI::rebuild(Node** in){
+  return new NodePropsSI(in, *this);
 }
@@ -5,11 +5,17 @@
 #include <cmath>          // math functions
 #include <map>            // store variables
 #include <set>            // sets variables names
+#include <vector>         // slots values
+#include <algorithm>      // set_union
+#include <iterator>       // back_inserter
+#include <unordered_map>  // shared nodes
 #include <stdexcept>      // exceptions
+#include <atomic>         // owners
 
 #include "CoolProp.h"     // PropsSI
 #include "AbstractState.h"     // PropsSI
 #include "HumidAirProp.h" // HAPropsSI
+#include "props.hpp"      // cache of properties
 
 // Scope
 typedef std::map<std::string,double> Scope;
@@ -17,24 +23,59 @@ typedef std::map<std::string,double> Scope;
 // StringSet
 using StringSet = std::set<std::string>;
 
+class Node;
+
+/**
+ * Variable table
+ * maps each variable name to a dense integer slot and stores its value
+ */
+struct VarTable{
+  std::map<std::string,int> slots;
+  std::vector<std::string> names;
+  std::vector<double> values;
+  std::vector<char> known; // value is given or solved
+  std::vector<double> lower, upper; // bounds (infinite if not declared)
+  std::vector<double> nominal;      // magnitude (0 if not declared)
+  int add(const std::string &name);
+  void load(const Scope &local);
+  std::vector<int> unknowns(Node* tree) const;
+};
+
 /**
  * Abstract Node 
+ * nodes are immutable and shared between trees (reference counted)
  */
 class Node {
 public:
+  std::atomic<int> refs{1}; // owners of the node (tapes read it in threads)
   virtual ~Node()=default;
   virtual char get_type() {return ' ';}
   virtual char get_op() {return ' ';}
   virtual int get_n() {return 0;}
   virtual Node** get_inputs() {return nullptr;}
-  virtual double eval(Scope &local){return 0;}
-  virtual StringSet findVars(Scope &local){return StringSet();}
+  virtual int get_slot() {return -1;}
+  virtual double eval(const double* x){return 0;}
+  virtual const std::vector<int>& get_slots();
   virtual std::string toString(){return "";}
-  virtual Node* get_copy(){return nullptr;}
-  virtual void swap_var(std::string var, Node* tree){};
+  virtual Node* rebuild(Node** in);
+  virtual Node* derive(int slot);
 };
 
+Node* share(Node* tree);
+void release(Node* tree);
+Node* intern(Node* tree);
+Node* substitute(Node* tree, int slot, Node* value);
+Node* simplify(Node* tree, const VarTable &table);
+Node* simplifyEquation(Node* tree, const VarTable &table);
+
 double evalOp(const double left,const double right,const char op);
+Node* makeOp(char op, Node* a, Node* b);
+Node* makeFun(std::string alias, Node* a);
+Node* makeFun(unsigned char code, Node* a);
+std::string funAlias(Node* tree);
+bool isFunction(const std::string &alias, int n);
+double evalFunOne(const unsigned char code,const double value);
+double diffFunOne(const unsigned char code,const double value);
 
 /**
  * NodeDouble - stores a double
@@ -44,9 +85,8 @@ class NodeDouble : public Node {
 public:
   NodeDouble(double input){value = input;}
   virtual char get_type() {return 'n';}
-  virtual double eval(Scope &local) {return value;}
+  virtual double eval(const double* x) {return value;}
   virtual std::string toString(){return std::to_string(value);}
-  virtual NodeDouble* get_copy(){return new NodeDouble(value);}
 };
 
 /**
@@ -58,22 +98,24 @@ public:
   NodeString(std::string input){word = input;}
   virtual char get_type(){return 'w';}
   virtual std::string toString(){return word;}
-  virtual NodeString* get_copy(){return new NodeString(word);}
 };
 
 /**
  * Variable Node
- * variables are double values stored in Scope
+ * variables are double values stored in a slot of VarTable
  */
 class NodeVar : public Node {
   std::string name;
+  int slot;
+  std::vector<int> incidence;
 public:
-  NodeVar(std::string input){name = input;}
+  NodeVar(std::string input, int index){name = input; slot = index; incidence.push_back(index);}
   virtual char get_type(){return 'v';}  
-  virtual double eval(Scope &local){return local[name];}
+  virtual int get_slot(){return slot;}
+  virtual double eval(const double* x){return x[slot];}
   virtual std::string toString(){return name;}
-  virtual NodeVar* get_copy(){return new NodeVar(name);}
-  virtual StringSet findVars(Scope &local);
+  virtual const std::vector<int>& get_slots(){return incidence;}
+  virtual Node* derive(int var);
 };
 
 /**
@@ -82,21 +124,26 @@ public:
 class NodeFun : public Node{
 protected:
   char op;
-  int n;
-  Node** inputs;
+  int n = 0;
+  Node** inputs = nullptr;
+  std::vector<int> incidence; // sorted slots of the subtree
+  bool stale = true;          // incidence is not computed yet
 public:
   NodeFun(std::string alias, int number, Node** var);
+  NodeFun(unsigned char code, int number, Node** var);
   NodeFun()=default;
   virtual ~NodeFun();
   virtual char get_type(){return 'f';}
   virtual char get_op(){return op;}
   virtual int get_n(){return n;}
   virtual Node** get_inputs(){return inputs;}
-  virtual double eval(Scope &local);
-  virtual StringSet findVars(Scope &local);
+  virtual double eval(const double* x);
+  virtual double call(const double* args);
+  virtual double partial(double* args, int k, double y);
+  virtual const std::vector<int>& get_slots();
   virtual std::string toString();
-  virtual NodeFun* get_copy();
-  virtual void swap_var(std::string var, Node* tree);
+  virtual NodeFun* rebuild(Node** in);
+  virtual Node* derive(int slot);
 };
 
 /**
@@ -106,11 +153,23 @@ public:
 class NodePropsSI : public NodeFun{
 protected:
   double TMAX,PMAX,TMIN,PMIN;
+  int fluid;                   // id in the fluid registry
+  CoolProp::parameters output; // resolved at parse time
+  CoolProp::parameters keys[2]; // inputs
+  CoolProp::input_pairs pair;
+  bool swap;                   // inputs in the opposite order of the pair
+  bool trivial;                // output is a constant of the fluid, no pair
+  char first, second;          // 'T', 'P' or 0 for the limit checks
+  std::string key;             // properties cache
 public:
   NodePropsSI(std::string alias, int number, Node** var);
-  NodePropsSI(Node** in, double Tmax, double Pmax, double Tmin, double Pmin);
-  virtual double eval(Scope &local);
-  virtual NodePropsSI* get_copy();
+  NodePropsSI(Node** in, const NodePropsSI &other);
+  virtual double call(const double* args);
+  virtual double partial(double* args, int k, double y);
+  virtual NodePropsSI* rebuild(Node** in);
+  bool limits(int k, double &lower, double &upper) const;
+  int get_fluid() const {return fluid;}
+  bool sameCall(const NodePropsSI &other) const;
 };
 
 
@@ -121,9 +180,10 @@ class NodeOp : public NodeFun {
 public:
   NodeOp(char symbol, Node* a, Node* b);
   virtual char get_type(){return 'o';}
-  virtual double eval(Scope &local);
+  virtual double eval(const double* x);
   virtual std::string toString();
-  virtual NodeOp* get_copy();
+  virtual NodeOp* rebuild(Node** in);
+  virtual Node* derive(int slot);
 };
 
 #endif // _NODE_
@@ -113,7 +113,7 @@ void addOperation(std::stack<char>& opStack, std::stack<Node*>& tkStack){
   Node* left = tkStack.top();
   tkStack.pop();
   Node* tree;
-  tree = new NodeOp(opStack.top(),left,right);
+  tree = intern(new NodeOp(opStack.top(),left,right));
   opStack.pop();
   tkStack.push(tree);
 }
@@ -136,10 +136,11 @@ void addFunction(std::stack<std::string> &funStack,
   // Verify if it is a CoolProp function
   std::string fName = funStack.top();
   if (n > 1 && fName == "PropsSI" ){
-    fun = new NodePropsSI(funStack.top(),n,inputs);
+    fun = intern(new NodePropsSI(funStack.top(),n,inputs));
   } else{
-    fun = new NodeFun(funStack.top(),n,inputs);
+    fun = intern(new NodeFun(funStack.top(),n,inputs));
   }
+  delete[] inputs; // copied by the node
   
   funStack.pop();
   tkStack.push(fun);
@@ -149,7 +150,7 @@ void addFunction(std::stack<std::string> &funStack,
 /**
  * Parses tokens into tree
  */
-Node* parseTokens(const std::vector<Token> &tokens){
+Node* parseTokens(const std::vector<Token> &tokens, VarTable &table){
   char code;
   int level;
   std::string letters;
@@ -164,7 +165,7 @@ Node* parseTokens(const std::vector<Token> &tokens){
     case 'n':
       {
 	// Number
-	Node* numbNode = new NodeDouble(stod(letters));
+	Node* numbNode = intern(new NodeDouble(stod(letters)));
 	tkStack.push(numbNode);
       }
       break;
@@ -172,7 +173,7 @@ Node* parseTokens(const std::vector<Token> &tokens){
       {
 	// Word - obs: you have to remove ' or "
 	letters = letters.substr(1,letters.length()-2);
-	Node* wordNode = new NodeString(letters);
+	Node* wordNode = intern(new NodeString(letters));
 	tkStack.push(wordNode);
       }
       break;
@@ -184,7 +185,7 @@ Node* parseTokens(const std::vector<Token> &tokens){
 	  opStack.push('f');
 	} else{
 	  // Variable (exclude functions for now)
-	  Node* var = new NodeVar(letters);
+	  Node* var = intern(new NodeVar(letters,table.add(letters)));
 	  tkStack.push(var);
 	}
       }
@@ -243,8 +244,8 @@ Node* parseTokens(const std::vector<Token> &tokens){
 /**
  * Parses a string into a tree
  */
-Node* parse(std::string line){
-  return parseTokens(tokenize(line));
+Node* parse(std::string line, VarTable &table){
+  return parseTokens(tokenize(line),table);
 }
 
 /**
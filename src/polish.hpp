@@ -21,7 +21,7 @@ void addFunction(std::stack<std::string> &funStack,
 		 std::stack<char> &opStack,
 		 std::stack<Node*> &tkStack);
 
-Node* parseTokens(const std::vector<Token> &tokens);
-Node* parse(std::string line);
+Node* parseTokens(const std::vector<Token> &tokens, VarTable &table);
+Node* parse(std::string line, VarTable &table);
 
 #endif 
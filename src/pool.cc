@@ -0,0 +1,106 @@
+#include "pool.hpp" // prototypes
+
+/**
+ * Pool shared by the solver (one thread per core, none in wasm)
+ */
+#ifdef __EMSCRIPTEN__
+ThreadPool threadPool(0);
+#else
+ThreadPool threadPool(std::thread::hardware_concurrency() > 1 ?
+		      std::thread::hardware_concurrency()-1 : 0);
+#endif
+
+/**
+ * ThreadPool constructor
+ * threads is the number of workers besides the caller
+ */
+ThreadPool::ThreadPool(unsigned threads){
+  for (unsigned i=0; i<threads; ++i){
+    workers.emplace_back(&ThreadPool::loop,this);
+  }
+}
+
+/**
+ * ThreadPool destructor
+ */
+ThreadPool::~ThreadPool(){
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stop = true;
+  }
+  wake.notify_all();
+  for (auto &worker:workers){
+    worker.join();
+  }
+}
+
+/**
+ * Runs indexes of a batch until none is left
+ */
+void ThreadPool::work(Batch &batch){
+  unsigned i;
+  while ((i = batch.next.fetch_add(1)) < batch.count){
+    batch.task(i);
+    if (batch.done.fetch_add(1)+1 == batch.count){
+      std::lock_guard<std::mutex> guard(batch.lock);
+      batch.finished.notify_all();
+    }
+  }
+}
+
+/**
+ * Worker: takes the oldest batch with indexes left
+ */
+void ThreadPool::loop(){
+  while (true){
+    std::shared_ptr<Batch> batch;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard,[this]{return stop || !pending.empty();});
+      if (stop){
+	return;
+      }
+      batch = pending.front();
+      if (batch->next.load() + 1 >= batch->count){
+	pending.pop_front(); // last index is being taken
+      }
+    }
+    work(*batch);
+  }
+}
+
+/**
+ * Runs task(i) for i in [0,count) and waits for all of them
+ */
+void ThreadPool::run(unsigned count, const std::function<void(unsigned)> &task){
+  if (count == 0){
+    return;
+  } else if (workers.empty() || count == 1){
+    for (unsigned i=0; i<count; ++i){
+      task(i);
+    }
+    return;
+  }
+  std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+  batch->task = task;
+  batch->count = count;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    pending.push_back(batch);
+  }
+  wake.notify_all();
+
+  // The caller works on its own batch, then waits for the others
+  work(*batch);
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto it=pending.begin(); it!=pending.end(); ++it){
+      if (*it == batch){
+	pending.erase(it);
+	break;
+      }
+    }
+  }
+  std::unique_lock<std::mutex> guard(batch->lock);
+  batch->finished.wait(guard,[&batch]{return batch->done.load() == batch->count;});
+}
@@ -0,0 +1,44 @@
+#ifndef _POOL_
+#define _POOL_
+
+#include <vector>             // workers
+#include <deque>              // pending batches
+#include <thread>             // workers
+#include <mutex>              // queue
+#include <condition_variable> // idle workers
+#include <atomic>             // batch counters
+#include <functional>         // tasks
+#include <memory>             // batches
+
+/**
+ * Thread pool
+ * runs the indexes of a task in parallel, the caller works too, so a task
+ * can use the pool again (nested batches do not deadlock)
+ * tasks must not create or release nodes (the unique nodes are not guarded)
+ */
+class ThreadPool{
+  struct Batch{
+    std::function<void(unsigned)> task;
+    unsigned count;
+    std::atomic<unsigned> next{0};
+    std::atomic<unsigned> done{0};
+    std::mutex lock;
+    std::condition_variable finished;
+  };
+  std::vector<std::thread> workers;
+  std::deque<std::shared_ptr<Batch>> pending;
+  std::mutex lock;
+  std::condition_variable wake;
+  bool stop = false;
+  static void work(Batch &batch);
+  void loop();
+public:
+  ThreadPool(unsigned threads);
+  ~ThreadPool();
+  unsigned size() const {return workers.size()+1;}
+  void run(unsigned count, const std::function<void(unsigned)> &task);
+};
+
+extern ThreadPool threadPool;
+
+#endif // _POOL_
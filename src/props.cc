@@ -0,0 +1,248 @@
+#include "props.hpp" // prototypes
+#include <cstring>   // memcmp
+#include <cmath>     // NAN
+#include <stdexcept> // invalid_argument
+#include "CoolProp.h" // extract_backend
+
+/**
+ * Cache shared by every property node (cleared for each problem)
+ */
+PropsCache propsCache(4096,64);
+
+/**
+ * String calls of CoolProp, one at a time
+ */
+std::mutex frontLock;
+
+/**
+ * PropsCache constructor
+ */
+PropsCache::PropsCache(unsigned size, unsigned shards) : entries(size), locks(shards){
+}
+
+/**
+ * Entry of a call
+ */
+unsigned PropsCache::index(const std::string &key, const double* args, int n){
+  size_t h = std::hash<std::string>()(key);
+  for (int i=0; i<n; ++i){
+    h ^= std::hash<double>()(args[i]) + 0x9e3779b97f4a7c15 + (h<<6) + (h>>2);
+  }
+  return h % entries.size();
+}
+
+/**
+ * Looks for a previous call, counting hits and misses
+ */
+bool PropsCache::find(const std::string &key, const double* args, int n, double &value){
+  const unsigned i = index(key,args,n);
+  {
+    std::lock_guard<std::mutex> guard(locks[i % locks.size()]);
+    const Entry &entry = entries[i];
+    if (entry.used && entry.key == key &&
+	std::memcmp(entry.args,args,n*sizeof(double)) == 0){
+      value = entry.value;
+      hits.fetch_add(1,std::memory_order_relaxed);
+      return true;
+    }
+  }
+  misses.fetch_add(1,std::memory_order_relaxed);
+  return false;
+}
+
+/**
+ * Stores a call
+ */
+void PropsCache::store(const std::string &key, const double* args, int n, double value){
+  const unsigned i = index(key,args,n);
+  std::lock_guard<std::mutex> guard(locks[i % locks.size()]);
+  Entry &entry = entries[i];
+  entry.used = true;
+  entry.key = key;
+  std::memcpy(entry.args,args,n*sizeof(double));
+  entry.value = value;
+}
+
+/**
+ * Removes every entry and resets the counters
+ */
+void PropsCache::clear(){
+  for (unsigned s=0; s<locks.size(); ++s){
+    std::lock_guard<std::mutex> guard(locks[s]);
+    for (unsigned i=s; i<entries.size(); i+=locks.size()){
+      entries[i].used = false;
+    }
+  }
+  resetCounters();
+}
+
+/**
+ * Starts counting hits and misses again (the entries are kept)
+ */
+void PropsCache::resetCounters(){
+  hits = 0;
+  misses = 0;
+}
+
+/**
+ * Fluids used by the nodes (never removed, ids are stable)
+ */
+static std::deque<Fluid> fluids;
+static std::map<std::string,int> fluidIds;
+static std::mutex fluidLock;
+
+/**
+ * Backends of the current problem (fluid name -> HEOS, TTSE or BICUBIC)
+ * the empty name applies to every fluid
+ */
+static std::map<std::string,std::string> tabular;
+
+/**
+ * Selects the backend of the PropsSI nodes parsed after this call
+ * kind is HEOS (exact), TTSE or BICUBIC; fluid is a name or empty for all
+ */
+void setBackend(const std::string &kind, const std::string &fluid){
+  if (kind != "HEOS" && kind != "TTSE" && kind != "BICUBIC"){
+    throw std::invalid_argument("backend @setBackend");
+  }
+  std::lock_guard<std::mutex> guard(fluidLock);
+  if (fluid.empty()){
+    tabular.clear(); // every fluid
+  }
+  tabular[fluid] = kind;
+}
+
+/**
+ * Returns every fluid to the exact backend
+ */
+void clearBackends(){
+  std::lock_guard<std::mutex> guard(fluidLock);
+  tabular.clear();
+}
+
+/**
+ * Finds or registers a fluid ("BACKEND::name" or name for HEOS)
+ * limits are computed once per fluid, tables once per process
+ */
+int findFluid(const std::string &fluid){
+  std::lock_guard<std::mutex> guard(fluidLock);
+  Fluid info;
+  CoolProp::extract_backend(fluid,info.backend,info.name);
+  if (info.backend == "?"){
+    info.backend = "HEOS";
+  }
+  if (info.backend == "HEOS"){
+    auto mode = tabular.find(info.name);
+    if (mode == tabular.end()){
+      mode = tabular.find("");
+    }
+    if (mode != tabular.end() && mode->second != "HEOS"){
+      info.backend = mode->second+"&HEOS";
+    }
+  }
+  const std::string id = info.backend+"::"+info.name;
+  auto it = fluidIds.find(id);
+  if (it != fluidIds.end()){
+    return it->second;
+  }
+  std::unique_ptr<CoolProp::AbstractState> state(CoolProp::AbstractState::factory(info.backend,info.name));
+  info.Tmax = state->keyed_output(CoolProp::iT_max);
+  info.Pmax = state->keyed_output(CoolProp::iP_max);
+  info.Tcrit = state->keyed_output(CoolProp::iT_critical);
+  info.Pcrit = state->keyed_output(CoolProp::iP_critical);
+  info.Tmin = state->keyed_output(CoolProp::iT_min);
+  info.Pmin = state->keyed_output(CoolProp::iP_min);
+  fluids.push_back(info);
+  fluidIds[id] = fluids.size()-1;
+  return fluids.size()-1;
+}
+
+/**
+ * Fluid of an id
+ */
+const Fluid& getFluid(int id){
+  std::lock_guard<std::mutex> guard(fluidLock);
+  return fluids[id];
+}
+
+/**
+ * State of a fluid for the calling thread (created once per thread)
+ * the last inputs are kept to skip repeated updates
+ */
+struct FluidState{
+  std::unique_ptr<CoolProp::AbstractState> state;
+  CoolProp::input_pairs pair = CoolProp::INPUT_PAIR_INVALID;
+  double value1, value2;
+};
+
+static FluidState& fluidHandle(int id){
+  thread_local std::vector<FluidState> states;
+  if (id >= (int)states.size()){
+    states.resize(id+1);
+  }
+  FluidState &handle = states[id];
+  if (!handle.state){
+    const Fluid &info = getFluid(id);
+    handle.state.reset(CoolProp::AbstractState::factory(info.backend,info.name));
+  }
+  return handle;
+}
+
+static CoolProp::AbstractState& fluidState(int id, CoolProp::input_pairs pair,
+					   double value1, double value2){
+  FluidState &handle = fluidHandle(id);
+  if (handle.pair != pair || handle.value1 != value1 || handle.value2 != value2){
+    handle.pair = CoolProp::INPUT_PAIR_INVALID; // until the update succeeds
+    handle.state->update(pair,value1,value2);
+    handle.pair = pair;
+    handle.value1 = value1;
+    handle.value2 = value2;
+  }
+  return *handle.state;
+}
+
+/**
+ * Output of a fluid at a state, NAN if CoolProp fails
+ */
+double fluidOutput(int id, CoolProp::parameters output, CoolProp::input_pairs pair,
+		   double value1, double value2){
+  try{
+    return fluidState(id,pair,value1,value2).keyed_output(output);
+  } catch (std::exception &e){
+    return NAN;
+  }
+}
+
+/**
+ * Output that doesn't depend on the state (Tcrit, M, ...), NAN if CoolProp fails
+ */
+double fluidOutput(int id, CoolProp::parameters output){
+  try{
+    return fluidHandle(id).state->keyed_output(output);
+  } catch (std::exception &e){
+    return NAN;
+  }
+}
+
+/**
+ * Partial derivative (d output/d wrt) at constant input, NAN if CoolProp fails
+ * the state was already updated by fluidOutput; cases that CoolProp rejects
+ * (quality inputs, two phase states) are checked before the call, since the
+ * wasm build aborts on exceptions instead of catching them
+ */
+double fluidPartial(int id, CoolProp::parameters output, CoolProp::parameters wrt,
+		    CoolProp::parameters constant, CoolProp::input_pairs pair,
+		    double value1, double value2){
+  if (wrt == CoolProp::iQ || constant == CoolProp::iQ){
+    return NAN;
+  }
+  try{
+    CoolProp::AbstractState &state = fluidState(id,pair,value1,value2);
+    if (state.phase() == CoolProp::iphase_twophase){
+      return NAN;
+    }
+    return state.first_partial_deriv(output,wrt,constant);
+  } catch (std::exception &e){
+    return NAN;
+  }
+}
@@ -0,0 +1,78 @@
+#ifndef _PROPS_
+#define _PROPS_
+
+#include <string>     // keys
+#include <vector>     // entries
+#include <mutex>      // shared by threads
+#include <deque>      // fluids
+#include <map>        // fluid names
+#include <memory>     // states
+#include <atomic>     // counters
+
+#include "AbstractState.h"  // CoolProp low level interface
+#include "DataStructures.h" // CoolProp keys
+
+/**
+ * Property cache
+ * bounded memo of CoolProp calls, an entry is overwritten on collision
+ * keys are the function, output, input names and fluid; values are the inputs
+ * entries are guarded by shards of locks, so threads rarely wait
+ */
+class PropsCache{
+  struct Entry{
+    bool used = false;
+    std::string key;
+    double args[3];
+    double value;
+  };
+  std::vector<Entry> entries;
+  std::vector<std::mutex> locks; // entry i is guarded by locks[i % size]
+  unsigned index(const std::string &key, const double* args, int n);
+public:
+  std::atomic<unsigned long> hits{0};   // since resetCounters, by the
+  std::atomic<unsigned long> misses{0}; // caller of the solve or sweep
+  PropsCache(unsigned size, unsigned shards);
+  bool find(const std::string &key, const double* args, int n, double &value);
+  void store(const std::string &key, const double* args, int n, double value);
+  void clear();
+  void resetCounters();
+};
+
+extern PropsCache propsCache;
+
+/**
+ * Guards the string calls of CoolProp (HAPropsSI keeps global states)
+ */
+extern std::mutex frontLock;
+
+/**
+ * Fluid
+ * backend and name resolved once, limits shared by every node of the fluid
+ */
+struct Fluid{
+  std::string backend;
+  std::string name;
+  double Tmax, Pmax, Tcrit, Pcrit, Tmin, Pmin;
+};
+
+/**
+ * Tabular backends, opt-in with @backend(TTSE) or @backend(BICUBIC, fluid)
+ * CoolProp builds the tables of a fluid once and keeps them on disk
+ * (~/.CoolProp/Tables), later processes load them. Interpolation error is
+ * about 1e-5 relative for bicubic and 1e-3 for TTSE in the single phase
+ * region, larger near the critical point; two phase states use saturation
+ * tables. Meant for screening studies, not for final results.
+ */
+void setBackend(const std::string &kind, const std::string &fluid);
+void clearBackends();
+
+int findFluid(const std::string &fluid);
+const Fluid& getFluid(int id);
+double fluidOutput(int id, CoolProp::parameters output, CoolProp::input_pairs pair,
+		   double value1, double value2);
+double fluidOutput(int id, CoolProp::parameters output);
+double fluidPartial(int id, CoolProp::parameters output, CoolProp::parameters wrt,
+		    CoolProp::parameters constant, CoolProp::input_pairs pair,
+		    double value1, double value2);
+
+#endif // _PROPS_
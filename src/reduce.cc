@@ -1,25 +1,20 @@
 #include "reduce.hpp"
+#include "model.hpp" // solveProblem
     
-/**
- * Comparison for sorting equations
- */
-bool lessVar::operator() (Node* first, Node* second){
-  int nF = (first->findVars(*local)).size();
-  int nS = (second->findVars(*local)).size();
-  return (nF<nS);
-}
-
 /**
  * Verifies if a tree is "simple"
  */
-bool simple(Node* tree,Scope &local){
+bool simple(Node* tree,const VarTable &table){
+  if (tree->get_type() != 'o' || tree->get_op() != '-'){
+    return false; // not lhs - rhs
+  }
   Node** childs = tree -> get_inputs();
   char lT = childs[0] -> get_type();
   if (lT == 'v'){
-    std::string name = childs[0]->toString();
-    if (local.find(name) == local.end()){
-      StringSet vars = childs[1]->findVars(local);
-      return (vars.find(name) == vars.end());
+    const int slot = childs[0]->get_slot();
+    if (!table.known[slot]){
+      const std::vector<int> &vars = childs[1]->get_slots();
+      return !std::binary_search(vars.begin(),vars.end(),slot);
     } else{
       return false;
     }
@@ -30,18 +25,18 @@ bool simple(Node* tree,Scope &local){
 /**
  * Removes simple equations from a forest
  */
-std::vector<Node*> removeSimple(std::vector<Node*> &forest, Scope &local){
+std::vector<Node*> removeSimple(std::vector<Node*> &forest, const VarTable &table){
   std::vector<Node*> simpleEquations;
-  StringSet names;
+  std::vector<char> taken(table.names.size(),0);
   for (unsigned i = 0; i<forest.size(); ++i){
     // Check if simple and erase
-    if (simple(forest[i],local)){
+    if (simple(forest[i],table)){
       Node** inputs = forest[i] -> get_inputs();
-      std::string name = inputs[0] -> toString();
-      if (names.find(name) == names.end()){
+      const int slot = inputs[0] -> get_slot();
+      if (!taken[slot]){
 	// Add name to subs
 	simpleEquations.push_back(forest[i]);
-	names.insert(name);
+	taken[slot] = 1;
 	// Erase from original
 	forest.erase(forest.begin()+i);
 	--i; // to avoid errors since tree is resized
@@ -53,16 +48,19 @@ std::vector<Node*> removeSimple(std::vector<Node*> &forest, Scope &local){
 
 /**
  * Applies algebric substitutions in simple and other equations
+ * expressions are shared, not copied, by the substituted trees
  */
-void algebraicSubs(std::vector<Node*> &simple, std::vector<Node*> &others, Scope &local){
+void algebraicSubs(std::vector<Node*> &simple, std::vector<Node*> &others, const VarTable &vtable){
   // Possible substitutions
   const unsigned n = simple.size();
-  std::string *names = new std::string[n];
+  std::vector<int> slots(n);
   Node** rightForest = new Node*[n];
+  std::vector<int> sub(vtable.names.size(),-1); // slot -> substitution
   for (unsigned i=0; i<n; ++i){
     Node** inputs = simple[i] -> get_inputs();
-    names[i] = inputs[0] -> toString();
-    rightForest[i] = inputs[1];
+    slots[i] = inputs[0] -> get_slot();
+    rightForest[i] = share(inputs[1]);
+    sub[slots[i]] = i;
   }
 
   // Table of substitutions
@@ -78,13 +76,13 @@ void algebraicSubs(std::vector<Node*> &simple, std::vector<Node*> &others, Scope
   while (flag){
     flag = false;
     for (unsigned i = 0; i<n; ++i){ // eq
-      Node** inputs = simple[i] -> get_inputs();
-      StringSet rightSide = inputs[1]->findVars(local);
+      std::vector<int> rightSide = rightForest[i]->get_slots();
       for (unsigned j = 0; j<simple.size(); ++j){ // eq - name/subs
-	if (table[i+j*n] && (rightSide.find(names[j]) != rightSide.end())){
+	if (table[i+j*n] && std::binary_search(rightSide.begin(),rightSide.end(),slots[j])){
 	  // Substitute var in 'j' by expression of 'j' in equation 'i'
-	  inputs[1] -> swap_var(names[j],rightForest[j]);
-	  rightForest[i] = inputs[1];
+	  Node* tree = substitute(rightForest[i],slots[j],rightForest[j]);
+	  release(rightForest[i]);
+	  rightForest[i] = tree;
 	  // Exclude this possibity
 	  table[i+j*n] = false;
 	  table[j+i*n] = false;
@@ -100,164 +98,431 @@ void algebraicSubs(std::vector<Node*> &simple, std::vector<Node*> &others, Scope
   // Release memory
   delete[] table;
 
-  // Substitute in the main equations;
+  // Simple equations with the substituted expressions
+  for (unsigned i = 0; i<n; ++i){
+    Node** inputs = simple[i] -> get_inputs();
+    Node* in[2] = {share(inputs[0]),share(rightForest[i])};
+    Node* tree = intern(simple[i] -> rebuild(in));
+    release(simple[i]);
+    simple[i] = tree;
+  }
+
+  // Substitute in the main equations (in the order of simple)
+  std::vector<int> found;
   for (unsigned i = 0; i<others.size(); ++i){ // eq
-    StringSet expression = others[i] -> findVars(local);
-    for (unsigned j = 0; j<n; ++j){ // eq - name/subs
-      if (expression.find(names[j]) != expression.end()){
-	// Substitute var in 'j' by expression of 'j' in equation 'i'
-	others[i] -> swap_var(names[j],rightForest[j]);
-      } else{
-	continue;
+    found.clear();
+    for (int slot:others[i] -> get_slots()){
+      if (sub[slot] != -1){
+	found.push_back(sub[slot]);
       }
     }
+    std::sort(found.begin(),found.end());
+    for (int j:found){ // eq - name/subs
+      // Substitute var in 'j' by expression of 'j' in equation 'i'
+      Node* tree = substitute(others[i],slots[j],rightForest[j]);
+      release(others[i]);
+      others[i] = tree;
+    }
+  }
+
+  for (unsigned i = 0; i<n; ++i){
+    release(rightForest[i]);
   }
+  delete[] rightForest;
 }
 
 /**
- * Separates equations into blocks and solve them
+ * Maximum matching of equations to variables (Hopcroft-Karp)
  */
-void solveByBlocks(std::vector<Node*> &equations, Scope &solutions){
-  lessVar condition(solutions); // Wrap Scope into lessVar
+static int matchEquations(const std::vector<std::vector<int>> &adj, int nVars,
+			  std::vector<int> &matchEq, std::vector<int> &matchVar){
+  const int n = adj.size();
+  const int INF = std::numeric_limits<int>::max();
+  matchEq.assign(n,-1);
+  matchVar.assign(nVars,-1);
+  std::vector<int> dist(n), queue(n), next(n), path;
+  int size = 0;
 
-  while (!equations.empty()){    
-    // Wrapped with scope (very important)
-    std::sort(equations.begin(),equations.end(),condition);
-    
-    // Create a block
-    StringSet varBlocks = equations[0] -> findVars(solutions);
-    std::vector<Node*> block;
+  // Greedy start
+  for (int u=0; u<n; ++u){
+    for (int v:adj[u]){
+      if (matchVar[v] == -1){
+	matchEq[u] = v;
+	matchVar[v] = u;
+	++size;
+	break;
+      }
+    }
+  }
 
-    // for (auto &name:varBlocks){
-    //   std::cout << name << std::endl;
-    // }
-    
-    // Verify if a lower block is possible
-    if (varBlocks.size() < equations.size()){
-      block.push_back(equations[0]);
-      equations.erase(equations.begin());
-    } else if (varBlocks.size() > equations.size()){
-      throw std::invalid_argument("More variables than equations");
-    } else{
-      std::swap(equations,block);
+  while (true){
+    // Layers from free equations
+    int head = 0, tail = 0;
+    for (int u=0; u<n; ++u){
+      if (matchEq[u] == -1){
+	dist[u] = 0;
+	queue[tail++] = u;
+      } else{
+	dist[u] = INF;
+      }
     }
-    
-    // Progressively add equations to the block
-    while (varBlocks.size() != block.size()){
-      for (unsigned i=0;i<equations.size(); ++i){
-	// add a new set if it shares variables
-	StringSet varEq = equations[i] -> findVars(solutions);
-	for (auto &name:varEq){
-	  if (varBlocks.find(name) != varBlocks.end()){
-	    block.push_back(equations[i]);
-	    varBlocks.insert(varEq.begin(),varEq.end());
-	    equations.erase(equations.begin()+i);
-	    --i;
-	    break;
-	  }
-	}
-	// check block size
-	if (varBlocks.size() == block.size()){
-	  break;
+    bool found = false;
+    while (head < tail){
+      int u = queue[head++];
+      for (int v:adj[u]){
+	int w = matchVar[v];
+	if (w == -1){
+	  found = true;
+	} else if (dist[w] == INF){
+	  dist[w] = dist[u]+1;
+	  queue[tail++] = w;
 	}
       }
     }
-    
-    // Solve block
-    const unsigned max_count = 20;
-    bool converged;
-    for (unsigned i=0; i < max_count; ++i){
-      // Try first Brent and after Newton
-      if (block.size() == 1 && i == 0){
-	converged = solve(block[0],solutions);
-      } else{
-	converged = solve(block,solutions,i);
-      }	
-      if (converged){
-	break;
-      } else{
-	// Clear guesses
-	for (const auto &name:varBlocks){
-	  solutions.erase(name);
+    if (!found){
+      break;
+    }
+
+    // Augmenting paths along the layers (iterative DFS)
+    std::fill(next.begin(),next.end(),0);
+    for (int root=0; root<n; ++root){
+      if (matchEq[root] != -1){
+	continue;
+      }
+      path.assign(1,root);
+      while (!path.empty()){
+	int u = path.back();
+	if (next[u] == (int)adj[u].size()){
+	  dist[u] = INF;
+	  path.pop_back();
+	  continue;
+	}
+	int w = matchVar[adj[u][next[u]]];
+	if (w == -1){
+	  for (int e:path){
+	    int v = adj[e][next[e]];
+	    matchEq[e] = v;
+	    matchVar[v] = e;
+	  }
+	  ++size;
+	  break;
+	} else if (dist[w] == dist[u]+1){
+	  path.push_back(w);
+	} else{
+	  ++next[u];
 	}
       }
-      // catch (std::exception &e){
-      // 	++count;
-      // 	// Clear guesses
-      // 	for (const auto &name:varBlocks){
-      // 	  solutions.erase(name);
-      // 	}
-      // 	continue;
-      // }
     }
-    
-    if (!converged){
-      throw std::invalid_argument("not converged @solveByBlocks");
+  }
+  return size;
+}
+
+/**
+ * Orders equations in block lower triangular form
+ */
+std::vector<std::vector<Node*>> blockTriangular(std::vector<Node*> &equations, const VarTable &table){
+  // Incidence of unknown variables
+  const int n = equations.size();
+  std::vector<int> index(table.names.size(),-1); // slot -> column
+  int columns = 0;
+  std::vector<std::vector<int>> adj(n);
+  for (int i=0; i<n; ++i){
+    for (int slot:table.unknowns(equations[i])){
+      if (index[slot] == -1){
+	index[slot] = columns++;
+      }
+      adj[i].push_back(index[slot]);
     }
+  }
+  if (columns > n){
+    throw std::invalid_argument("More variables than equations");
+  } else if (columns < n){
+    throw std::invalid_argument("More equations than variables");
+  }
+
+  // Each equation is assigned to one variable
+  std::vector<int> matchEq, matchVar;
+  if (matchEquations(adj,n,matchEq,matchVar) < n){
+    throw std::invalid_argument("Structurally singular system @blockTriangular");
+  }
 
-    // Release memory
-    for(auto &eq:block){
-      delete eq;
+  // Tarjan SCC: equation i depends on the equation matched to each of its variables
+  std::vector<std::vector<Node*>> blocks;
+  std::vector<int> order(n,-1), low(n), next(n,0), stack, path;
+  std::vector<char> onStack(n,0);
+  int count = 0;
+  for (int root=0; root<n; ++root){
+    if (order[root] != -1){
+      continue;
+    }
+    path.push_back(root);
+    while (!path.empty()){
+      int u = path.back();
+      if (next[u] == 0 && order[u] == -1){
+	order[u] = low[u] = count++;
+	stack.push_back(u);
+	onStack[u] = 1;
+      }
+      if (next[u] < (int)adj[u].size()){
+	int w = matchVar[adj[u][next[u]++]];
+	if (order[w] == -1){
+	  path.push_back(w);
+	} else if (onStack[w]){
+	  low[u] = std::min(low[u],order[w]);
+	}
+	continue;
+      }
+      // Root of a component: dependencies were already emitted
+      path.pop_back();
+      if (!path.empty()){
+	low[path.back()] = std::min(low[path.back()],low[u]);
+      }
+      if (low[u] == order[u]){
+	std::vector<Node*> block;
+	int w;
+	do{
+	  w = stack.back();
+	  stack.pop_back();
+	  onStack[w] = 0;
+	  block.push_back(equations[w]);
+	} while (w != u);
+	blocks.push_back(block);
+      }
     }
   }
+  return blocks;
 }
 
 /**
- * Solves the problem
+ * Runs the blocks of a DAG on the pool
+ * a block starts as soon as the blocks before it are done, independent
+ * blocks run concurrently; the first failure is thrown again here
  */
-void solveProblem(std::vector<std::string> &lines, Scope &solutions){
-  /**
-   * Get equations
-   * Solve equations if possible, otherwise store it
-   */
-  
-  std::vector<Node*> equations;
-  for (unsigned j=0; j<lines.size(); ++j){
-    Node* line = parse(lines[j]);
-    StringSet lineVars = line -> findVars(solutions);
-    // std::cout << "(" << j << ")" << "\t" << line -> toString() << std::endl;
-    bool converged;
-    if (lineVars.size() == 1){
-      //try{
-      converged = solve(line,solutions);
-      if (converged){
-	delete line; // clear memory
-      } else { //catch (std::exception &e){
-	equations.push_back(line);
+void runBlocks(const std::vector<std::vector<int>> &after, const std::function<void(unsigned)> &task){
+  // Blocks wait for the blocks they use
+  const unsigned count = after.size();
+  std::vector<int> waiting(count,0);
+  for (const auto &list:after){
+    for (int b:list){
+      ++waiting[b];
+    }
+  }
+  std::deque<int> ready;
+  for (unsigned b=0; b<count; ++b){
+    if (waiting[b] == 0){
+      ready.push_back(b);
+    }
+  }
+
+  // Each worker takes ready blocks until every block is solved
+  std::mutex lock;
+  std::condition_variable change;
+  unsigned done = 0;
+  std::exception_ptr failure;
+  const unsigned workers = std::min<unsigned>(threadPool.size(),count);
+  threadPool.run(workers,[&](unsigned){
+    std::unique_lock<std::mutex> guard(lock);
+    while (true){
+      change.wait(guard,[&]{return !ready.empty() || done == count || failure;});
+      if (done == count || failure){
+	return;
       }
-    } else{
-      equations.push_back(line);
+      const int b = ready.front();
+      ready.pop_front();
+      guard.unlock();
+      try{
+	task(b);
+      } catch (...){
+	guard.lock();
+	failure = std::current_exception();
+	change.notify_all();
+	return;
+      }
+      guard.lock();
+      ++done;
+      for (int c:after[b]){
+	if (--waiting[c] == 0){
+	  ready.push_back(c);
+	}
+      }
+      change.notify_all();
     }
+  });
+  if (failure){
+    std::rethrow_exception(failure);
   }
-  
-  /**
-   * Split the problem
-   * Simple equations can be excluded from the main problem
-   */
-  std::vector<Node*> simple;
-  if (!equations.empty()){
-    simple = removeSimple(equations,solutions);
-    algebraicSubs(simple,equations,solutions);
+}
+
+/**
+ * Number of a directive argument
+ */
+static double directiveValue(const std::string &arg, const std::string &name){
+  std::size_t end = 0;
+  double value = 0;
+  try{
+    value = std::stod(arg,&end);
+  } catch (const std::exception &){
+    end = 0;
+  }
+  if (end == 0 || end != arg.size()){
+    throw std::invalid_argument("value not a number @"+name);
   }
+  return value;
+}
 
-  // for (unsigned i=0;i<equations.size();++i){
-  //   std::cout << equations[i]->toString() << std::endl;
-  // }
-  // std::cout << std::endl;
-  // for (unsigned i=0;i<simple.size();++i){
-  //   std::cout << simple[i]->toString() << std::endl;
-  // }
-  // std::cout << std::endl;
+/**
+ * Applies a model directive
+ * @backend(kind) or @backend(kind, fluid): PropsSI backend, see setBackend
+ * @guess(variable, value): first guess of a variable
+ * @bounds(variable, lower, upper): range of a variable (inf for none)
+ * @nominal(variable, value): magnitude of a variable, scales the solver
+ * @jacobian(mode): NUMERIC, FORWARD, REVERSE (default) or SYMBOLIC
+ */
+void directive(const std::string &line, Hints &hints){
+  std::string name;
+  std::vector<std::string> args = directiveArgs(line,name);
+  if (name == "backend" && (args.size() == 1 || args.size() == 2)){
+    setBackend(args[0], args.size() == 2 ? args[1] : "");
+  } else if (name == "guess" && args.size() == 2){
+    hints.guesses[args[0]] = directiveValue(args[1],name);
+  } else if (name == "bounds" && args.size() == 3){
+    const double lower = directiveValue(args[1],name);
+    const double upper = directiveValue(args[2],name);
+    if (!(lower < upper)){
+      throw std::invalid_argument("lower not below upper @bounds("+args[0]+")");
+    }
+    hints.bounds[args[0]] = std::make_pair(lower,upper);
+  } else if (name == "nominal" && args.size() == 2){
+    const double value = std::abs(directiveValue(args[1],name));
+    if (!(value > 0) || !std::isfinite(value)){
+      throw std::invalid_argument("nominal not positive @nominal("+args[0]+")");
+    }
+    hints.nominal[args[0]] = value;
+  } else if (name == "jacobian" && args.size() == 1){
+    const std::map<std::string,Jacobian> modes =
+      {{"NUMERIC",NUMERIC},{"FORWARD",FORWARD},{"REVERSE",REVERSE},{"SYMBOLIC",SYMBOLIC}};
+    auto it = modes.find(args[0]);
+    if (it == modes.end()){
+      throw std::invalid_argument("unknown mode @jacobian("+args[0]+")");
+    }
+    hints.mode = it->second;
+  } else{
+    throw std::invalid_argument("unknown directive @"+name);
+  }
+}
 
-  /**
-   * Blocks
-   * Solve problem spliting into smaller blocks when possible
-   */
-  if(!equations.empty()){
-    solveByBlocks(equations,solutions);
+/**
+ * Copies bounds and nominal values to the variables of a table
+ */
+void applyHints(const Hints &hints, VarTable &table){
+  auto slotOf = [&table](const std::string &name){
+    auto it = table.slots.find(name);
+    if (it == table.slots.end()){
+      throw std::invalid_argument("directive of a variable not in model @applyHints");
+    }
+    return it->second;
+  };
+  for (const auto &kv:hints.guesses){
+    slotOf(kv.first);
+  }
+  for (const auto &kv:hints.bounds){
+    const int slot = slotOf(kv.first);
+    table.lower[slot] = kv.second.first;
+    table.upper[slot] = kv.second.second;
+  }
+  for (const auto &kv:hints.nominal){
+    table.nominal[slotOf(kv.first)] = kv.second;
+  }
+}
+
+/**
+ * Bounds a variable from the range of an expression of it
+ * follows + - * / by numbers down to the variable, a range that leaves
+ * nothing of the current bounds is ignored
+ */
+static void boundVariable(Node* tree, double lower, double upper, VarTable &table){
+  if (tree->get_type() == 'v'){
+    const int slot = tree->get_slot();
+    lower = std::max(lower,table.lower[slot]);
+    upper = std::min(upper,table.upper[slot]);
+    if (lower < upper){
+      table.lower[slot] = lower;
+      table.upper[slot] = upper;
+    }
+    return;
+  } else if (tree->get_type() != 'o'){
+    return;
+  }
+  Node** inputs = tree->get_inputs();
+  const bool left = inputs[1]->get_type() == 'n'; // number at the right
+  if (!left && inputs[0]->get_type() != 'n'){
+    return;
+  }
+  Node* var = left ? inputs[0] : inputs[1];
+  const double c = left ? inputs[1]->eval(nullptr) : inputs[0]->eval(nullptr);
+  switch (tree->get_op()){
+  case '+':
+    boundVariable(var,lower-c,upper-c,table);
+    break;
+  case '-':
+    if (left){
+      boundVariable(var,lower+c,upper+c,table);
+    } else{
+      boundVariable(var,c-upper,c-lower,table);
+    }
+    break;
+  case '*':
+    if (c > 0){
+      boundVariable(var,lower/c,upper/c,table);
+    } else if (c < 0){
+      boundVariable(var,upper/c,lower/c,table);
+    }
+    break;
+  case '/':
+    if (left && c > 0){
+      boundVariable(var,lower*c,upper*c,table);
+    } else if (left && c < 0){
+      boundVariable(var,upper*c,lower*c,table);
+    }
+    break;
   }
+}
 
-  if(!simple.empty()){
-    solveByBlocks(simple,solutions);
+/**
+ * Infers bounds of the variables from the fluid limits of PropsSI
+ * the temperature and pressure inputs of each call bound the variables
+ * they are made of (slightly inside, the limits are open)
+ */
+void inferBounds(const std::vector<Node*> &equations, VarTable &table){
+  std::unordered_set<Node*> seen;
+  std::vector<Node*> stack(equations.begin(),equations.end());
+  while (!stack.empty()){
+    Node* tree = stack.back();
+    stack.pop_back();
+    if (!seen.insert(tree).second){
+      continue;
+    }
+    Node** inputs = tree->get_inputs();
+    for (int i=0; i<tree->get_n(); ++i){
+      stack.push_back(inputs[i]);
+    }
+    NodePropsSI* props = dynamic_cast<NodePropsSI*>(tree);
+    double lower, upper;
+    for (int k=0; props != nullptr && k<2; ++k){
+      if (props->limits(k,lower,upper)){
+	const double margin = 1e-6*(upper-lower);
+	boundVariable(inputs[2+2*k],lower+margin,upper-margin,table);
+      }
+    }
   }
 }
+
+/**
+ * Solves the problem
+ * the model is analyzed and solved once, see Model to solve it again
+ */
+void solveProblem(std::vector<std::string> &lines, Scope &solutions){
+  Model model(lines);
+  Scope found = model.solve(Scope());
+  solutions.insert(found.begin(),found.end());
+}
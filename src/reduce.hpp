@@ -1,19 +1,33 @@
 #ifndef _REDUCE_
 #define _REDUCE_
 
+#include <limits>    // matching
+#include <deque>     // ready blocks
+#include <exception> // failures of workers
+#include <unordered_set> // visited nodes
 #include "solver.hpp"
+#include "text.hpp"  // directives
 
-struct lessVar {
-  Scope* local;
-  lessVar(Scope& input){local = &input;}
-  bool operator() (Node* first, Node* second);
+/**
+ * Hints
+ * values for the solver given by directives
+ */
+struct Hints{
+  Scope guesses; // @guess
+  std::map<std::string,std::pair<double,double>> bounds; // @bounds
+  Scope nominal; // @nominal
+  Jacobian mode = REVERSE; // @jacobian
 };
 
-bool simple(Node* tree,Scope &local);
-std::vector<Node*> removeSimple(std::vector<Node*> &forest, Scope &local);
-void algebraicSubs(std::vector<Node*> &simple, std::vector<Node*> &others, Scope &local);
+bool simple(Node* tree,const VarTable &table);
+std::vector<Node*> removeSimple(std::vector<Node*> &forest, const VarTable &table);
+void algebraicSubs(std::vector<Node*> &simple, std::vector<Node*> &others, const VarTable &vtable);
 
-void solveByBlocks(std::vector<Node*> &equations, Scope &solutions);
+std::vector<std::vector<Node*>> blockTriangular(std::vector<Node*> &equations, const VarTable &table);
+void runBlocks(const std::vector<std::vector<int>> &after, const std::function<void(unsigned)> &task);
+void directive(const std::string &line, Hints &hints);
+void applyHints(const Hints &hints, VarTable &table);
+void inferBounds(const std::vector<Node*> &equations, VarTable &table);
 void solveProblem(std::vector<std::string> &lines, Scope &solutions);
 
 #endif
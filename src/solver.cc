@@ -11,99 +11,244 @@
 /**
  * Variables constructor
  */
-Variables::Variables(const std::vector<Node*> &forest, Scope &local){
-  std::vector<StringSet> eq;
-  StringSet dummy;
+Variables::Variables(const std::vector<Node*> &forest, const VarTable &vtable){
+  std::vector<std::vector<int>> eq;
   for (const auto &tree : forest){
-    dummy = tree->findVars(local);
-    eq.push_back(dummy);
-    all.insert(dummy.begin(),dummy.end());
+    eq.push_back(vtable.unknowns(tree));
+    for (int slot:eq.back()){
+      all.insert(vtable.names[slot]);
+    }
+  }
+  
+  // Check size
+  if(all.size() != forest.size()){
+    throw std::invalid_argument("forest size @Variables");
+  }
+  
+  scaled = false;
+  for (const auto &name:all){
+    const int slot = vtable.slots.at(name);
+    slots.push_back(slot);
+    lower.push_back(vtable.lower[slot]);
+    upper.push_back(vtable.upper[slot]);
+    scale.push_back(vtable.nominal[slot] > 0 ? vtable.nominal[slot] : 1);
+    scaled = scaled || vtable.nominal[slot] > 0;
   }
   n = forest.size();
-  bool *store = new bool[n*n];
-  unsigned j = 0;
-  for (unsigned i=0; i<n; ++i){      // equation
-    j = 0;
-    for (const auto &name:all){ // name
-      if (eq[i].find(name) != eq[i].end()){
-	store[j+i*n] = true;
-      } else{
-	store[j+i*n] = false;
-      }
-      ++j;
+  std::vector<int> column(vtable.values.size(),-1); // of each slot in all
+  for (int j=0; j<n; ++j){
+    column[slots[j]] = j;
+  }
+  for (auto &row:eq){ // equation
+    for (auto &slot:row){
+      slot = column[slot];
     }
+    std::sort(row.begin(),row.end());
+  }
+  pattern = spmat(n,n,eq);
+
+  // Tapes
+  this->forest = forest;
+  width = vtable.values.size();
+  cost = 0;
+  for (const auto &tree:forest){
+    tapes.push_back(Tape(tree));
+    tapes.back().bind(slots);
+    cost += tapes.back().cost();
+    const std::vector<int> &read = tree->get_slots();
+    inputs.insert(inputs.end(),read.begin(),read.end());
   }
-  table = store;
+  std::sort(inputs.begin(),inputs.end());
+  inputs.erase(std::unique(inputs.begin(),inputs.end()),inputs.end());
 };
 
+/**
+ * Variables destructor
+ */
+Variables::~Variables(){
+  for (auto &tree:dtrees){
+    release(tree);
+  }
+}
+
 /**
  * Variables copy
+ * the tapes are copied, the derivative trees stay with the original (which
+ * has to outlive the copy): no node is shared or released, so any thread
+ * can make copies
  */
 Variables::Variables(const Variables &original){
   // To avoid double deletion and memory leaks
   n = original.n;
   all = original.all;
-  table = new bool[n*n];
-  for (unsigned i=0;i<n;++i){
-    for (unsigned j=0;j<n;++j){
-      table[j+i*n] = original.table[j+i*n];
+  slots = original.slots;
+  pattern = original.pattern;
+  forest = original.forest;
+  tapes = original.tapes;
+  width = original.width;
+  inputs = original.inputs;
+  cost = original.cost;
+  lower = original.lower;
+  upper = original.upper;
+  scale = original.scale;
+  scaled = original.scaled;
+  derivatives = original.derivatives;
+  dtapes = original.dtapes;
+}
+
+/**
+ * Builds the derivative trees of the jacobian entries
+ * entries that can't be derived are kept as -1
+ * creates nodes, so it runs before the blocks are handed to the pool
+ */
+void Variables::derive(){
+  derivatives.assign(pattern.index.size(),-1);
+  for (int i=0; i<n; ++i){   // equation
+    for (int k=pattern.start[i]; k<pattern.start[i+1]; ++k){
+      Node* tree = forest[i]->derive(slots[pattern.index[k]]);
+      if (tree != nullptr){
+	derivatives[k] = dtrees.size();
+	dtrees.push_back(tree);
+	dtapes.push_back(Tape(tree));
+	dtapes.back().bind(slots);
+      }
     }
   }
 }
 
+/**
+ * Folds the values known before the block is solved into its tapes
+ * (parameters and variables of earlier blocks), see Tape::fold
+ */
+void Variables::fold(const double* x){
+  for (auto &tape:tapes){
+    tape.fold(x);
+  }
+  for (auto &tape:dtapes){
+    tape.fold(x);
+  }
+}
+
 /**
  * Calculates the numerical derivative
  */
-double dfdx(Node* &tree, Scope &guess, std::string name, double y){
+double dfdx(Tape &tape, double* x, int slot, double y){
   // Set x
   const double rdiff = 1e-8;
-  const double x =  guess[name];
+  const double x0 =  x[slot];
   double dx;
-  dx = x==0 ? rdiff : x*(1+rdiff); // avoid zero difference
+  dx = x0==0 ? rdiff : x0*(1+rdiff); // avoid zero difference
 
   // Get y and dy/dx
-  guess[name] = dx;
-  double dy = tree -> eval(guess);
-  double dfdx = (dy-y)/(dx-x);
+  x[slot] = dx;
+  double dy = tape.eval(x);
+  double dfdx = (dy-y)/(dx-x0);
   
   // Set x back
-  guess[name] = x;
+  x[slot] = x0;
   return dfdx;
 }
 
 /**
  * Evaluates a vector of trees (forest)
  */
-void evalForest(const std::vector<Node*> &forest, Scope &guess, mat &answers, mat &side){
-  Node** root;
+void evalForest(std::vector<Tape> &tapes, const double* x, mat &answers, mat &side){
   double left, right, higher;
   for (unsigned i=0; i<answers.rows; ++i){
-    root = forest[i]->get_inputs();
-    left = root[0]->eval(guess);
-    right = root[1]->eval(guess);
+    tapes[i].evalSides(x,left,right);
     higher = left > right ? left : right;
     side.set(i,0,higher);
     answers.set(i,0,-(left-right)); // minus answer
   }
 }
 
+/**
+ * Evaluates an entry of the Jacobian
+ * k is the entry of row i in the pattern, y is the value of the equation
+ */
+double evalEntry(Variables &vars, double* x, unsigned i, int k, double y, Jacobian mode){
+  double value;
+  const int j = vars.pattern.index[k];
+  const int entry = vars.derivatives.empty() ? -1 : vars.derivatives[k];
+  if (mode == SYMBOLIC && entry >= 0){
+    return vars.dtapes[entry].eval(x);
+  } else if (mode == NUMERIC){
+    return dfdx(vars.tapes[i],x,vars.slots[j],y);
+  } else{
+    return vars.tapes[i].evalDual(x,vars.slots[j],value);
+  }
+}
+
+/**
+ * Runs the rows of a Jacobian, in parallel when they are expensive
+ * numeric rows perturb a private copy of the values
+ */
+static void evalRows(Variables &vars, double* x, unsigned rows, Jacobian mode,
+		     const std::function<void(unsigned,double*)> &row){
+  const unsigned long work = mode == REVERSE ? vars.cost : vars.cost*vars.n;
+  if (threadPool.size() == 1 || rows < 2 || work < 20000){
+    for (unsigned i=0; i<rows; ++i){
+      row(i,x);
+    }
+    return;
+  }
+  threadPool.run(rows,[&](unsigned i){
+    if (mode == NUMERIC){
+      thread_local std::vector<double> values;
+      copyValues(x,vars,values);
+      row(i,values.data());
+    } else{
+      row(i,x);
+    }
+  });
+}
+
 /**
  * Evaluates the Jacobian
  */
-void evalJacobian(std::vector<Node*> &forest, Scope &guess,const Variables &vars, mat &jac, mat &answers){
-  unsigned j;
-  double dummy;
-  for (unsigned i=0; i<jac.rows; ++i){      // equation
-    j = 0;
-    for (const auto &name:vars.all){ // name
-      dummy=0;
-      if (vars.table[j+i*jac.rows]){
-	dummy = dfdx(forest[i],guess,name,-answers.get(i,0)); // correct minus answer
+void evalJacobian(Variables &vars, double* x, mat &jac, mat &answers, Jacobian mode){
+  evalRows(vars,x,jac.rows,mode,[&](unsigned i, double* x){ // equation
+    if (mode == REVERSE){
+      double* row = jac.eArray+i*jac.columns;
+      for (int j=0; j<jac.columns; ++j){
+	row[j] = 0;
       }
-      jac.set(i,j,dummy);
-      ++j;
+      vars.tapes[i].evalGradient(x,row);
+      return;
     }
-  }
+    for (int j=0; j<jac.columns; ++j){ // slot
+      jac.set(i,j,0);
+    }
+    const spmat &pattern = vars.pattern;
+    for (int k=pattern.start[i]; k<pattern.start[i+1]; ++k){
+      jac.set(i,pattern.index[k],evalEntry(vars,x,i,k,-answers.get(i,0),mode)); // correct minus answer
+    }
+  });
+}
+
+/**
+ * Evaluates the Jacobian into a sparse matrix
+ * jac has the pattern of the variables
+ */
+void evalJacobian(Variables &vars, double* x, spmat &jac, mat &answers, Jacobian mode){
+  evalRows(vars,x,jac.rows,mode,[&](unsigned i, double* x){ // equation
+    if (mode == REVERSE){
+      // Only entries of the pattern are touched in the row
+      thread_local std::vector<double> row;
+      if (row.size() != (unsigned)jac.columns){
+	row.assign(jac.columns,0);
+      }
+      vars.tapes[i].evalGradient(x,row.data());
+      for (int k=jac.start[i]; k<jac.start[i+1]; ++k){
+	jac.values[k] = row[jac.index[k]];
+	row[jac.index[k]] = 0;
+      }
+      return;
+    }
+    for (int k=jac.start[i]; k<jac.start[i+1]; ++k){
+      jac.values[k] = evalEntry(vars,x,i,k,-answers.get(i,0),mode); // correct minus answer
+    }
+  });
 }
 
 /**
@@ -136,13 +281,35 @@ void evalBroyden(mat &jac, mat &dx, mat &df)
 }
 
 /**
- * Updates a scope with values from a mat
+ * Updates slot values with values from a mat
  */
-void updateScope(Scope &guess,const Variables &vars, const mat &guessN){
+void updateValues(double* x,const Variables &vars, const mat &guessN){
   // Here mat has to be sent as reference, otherwise the code will delete the values.
+  for (unsigned i=0; i<vars.slots.size(); ++i){
+    x[vars.slots[i]] = guessN.get(i,0);
+  }
+}
+
+/**
+ * Private copy of the values read by the tapes (other blocks may be
+ * writing the rest of x)
+ */
+void copyValues(const double* x, const Variables &vars, std::vector<double> &values){
+  values.assign(vars.width,0);
+  for (int slot:vars.inputs){
+    values[slot] = x[slot];
+  }
+}
+
+/**
+ * Exports slot values of the variables to a scope
+ * and marks them as known
+ */
+void updateScope(Scope &guess,const Variables &vars, VarTable &vtable){
   unsigned i = 0;
   for (const auto &name:vars.all){
-    guess[name] = guessN.get(i,0);
+    guess[name] = vtable.values[vars.slots[i]];
+    vtable.known[vars.slots[i]] = 1;
     ++i;
   }
 }
@@ -178,13 +345,13 @@ double evalError(const mat &answers,const mat &side){
 /**
  * Update scope, evaluate and sum errors
  */
-double evalError(const mat &guessN, Variables &vars, std::vector<Node*> &forest, Scope &guessScope){
+double evalError(const mat &guessN, Variables &vars, double* x){
   // Update	
-  updateScope(guessScope, vars, guessN);
+  updateValues(x, vars, guessN);
   // Calculate
   double error=0;
   for (unsigned i=0; i<guessN.rows; ++i){
-    error += pow(forest[i]->eval(guessScope),2);
+    error += pow(vars.tapes[i].eval(x),2);
     if (!isfinite(error)){
       break;
     }
@@ -197,10 +364,46 @@ bool lessError(Guess first, Guess second){
   return (abs(first.second)<abs(second.second));
 }
 
+/**
+ * Checks if less than two magnitudes of the list are inside the bounds of
+ * a name, then its guesses are spread over the bounds (see inBounds)
+ */
+static bool spreadGuesses(const Variables &vars, unsigned k, const double* list, unsigned count){
+  unsigned inside = 0;
+  for (unsigned j=0; j<count; ++j){
+    const double value = list[j]*vars.scale[k];
+    inside += value >= vars.lower[k] && value <= vars.upper[k];
+  }
+  return inside < 2;
+}
+
+/**
+ * Guess of a name from a magnitude of the list (value is jittered)
+ * magnitudes out of the bounds give NAN (the guess is skipped); spread
+ * guesses are a fraction of the way between two bounds or move past a
+ * single bound by the value
+ */
+static double inBounds(const Variables &vars, unsigned k, double magnitude, double value,
+		       double fraction, bool spread){
+  const double lower = vars.lower[k];
+  const double upper = vars.upper[k];
+  if (!spread){
+    if (magnitude < lower || magnitude > upper){
+      return NAN;
+    }
+    return std::min(std::max(value,lower),upper);
+  } else if (isfinite(lower) && isfinite(upper)){
+    return lower + (upper-lower)*fraction;
+  } else if (isfinite(lower)){
+    return lower + std::abs(value);
+  }
+  return upper - std::abs(value);
+}
+
 /**
  * Try values and find good guesses
  */
-std::vector<Guess> findGuess(Variables &vars, std::vector<Node*> &forest, Scope &guessScope, unsigned i){
+std::vector<Guess> findGuess(Variables &vars, double* x, unsigned i){
   mat guessN(vars.all.size(),1);
   double val, error;
   double list[8] = {0, 1e-3, 0.1, 1, 10, 200, 1e3, 1e5};
@@ -211,17 +414,27 @@ std::vector<Guess> findGuess(Variables &vars, std::vector<Node*> &forest, Scope
   unsigned seed = std::chrono::system_clock::now().time_since_epoch().count()+i*100;
   std::default_random_engine generator(seed);
   std::uniform_real_distribution<double> distribution(0.0,1.0);
+  std::vector<char> spread(guessN.rows);
+  for (int i=0;i<guessN.rows;++i){
+    spread[i] = spreadGuesses(vars,i,list,8);
+  }
 
   while (guessList.empty() && count < max_tries){
     for (unsigned j=0;j<8;++j){
       // Set value
+      bool inside = true;
       for (unsigned i=0;i<guessN.rows;++i){
 	signal = distribution(generator) > 0.5 ? 1 : -1;
-	val = (1+distribution(generator)*signal/2)*list[j]; // -/+ 10% guess
+	val = (1+distribution(generator)*signal/2)*list[j]*vars.scale[i]; // -/+ 10% guess
+	val = inBounds(vars,i,list[j]*vars.scale[i],val,(j+distribution(generator))/8,spread[i]);
+	inside = inside && !isnan(val);
 	guessN.set(i,0,val);
       }
+      if (!inside){
+	continue;
+      }
       // Update, evaluate and sum errors
-      error = evalError(guessN, vars, forest, guessScope);
+      error = evalError(guessN, vars, x);
       // Pair of guess
       if (isfinite(error)){
 	guessList.push_back(Guess(guessN,error));
@@ -243,9 +456,9 @@ std::vector<Guess> findGuess(Variables &vars, std::vector<Node*> &forest, Scope
  * Try n*n values for 2D problems
  * Slower, but more reliable
  */
-std::vector<Guess> findGuessPair(Variables &vars, std::vector<Node*> &forest, Scope &guessScope, unsigned i){
+std::vector<Guess> findGuessPair(Variables &vars, double* x, unsigned i){
   mat guessN(vars.all.size(),1);
-  double x,y, error;
+  double a,b, error;
   double list[8] = {0, 1e-3, 0.1, 1, 10, 200, 1e3, 1e5};
   std::vector<Guess> guessList;
   const short max_tries = 1;//0;
@@ -254,18 +467,28 @@ std::vector<Guess> findGuessPair(Variables &vars, std::vector<Node*> &forest, Sc
   unsigned seed = std::chrono::system_clock::now().time_since_epoch().count()+100*i;
   std::default_random_engine generator(seed);
   std::uniform_real_distribution<double> distribution(0.0,1.0);
+  const bool spreadA = spreadGuesses(vars,0,list,8);
+  const bool spreadB = spreadGuesses(vars,1,list,8);
 
   while (guessList.empty() && count < max_tries){
     for (unsigned j=0;j<8;++j){ 
       signal = distribution(generator) > 0.5 ? 1 : -1;
-      x = (1+distribution(generator)*signal/2)*list[j]; // 0 to + 1.000
-      guessN.set(0,0,x);
+      a = (1+distribution(generator)*signal/2)*list[j]*vars.scale[0]; // 0 to + 1.000
+      a = inBounds(vars,0,list[j]*vars.scale[0],a,(j+distribution(generator))/8,spreadA);
+      if (isnan(a)){
+	continue;
+      }
+      guessN.set(0,0,a);
       // Set value
       for (unsigned i=0;i<8;++i){
 	signal = distribution(generator) > 0.5 ? 1 : -1;
-	y = (1+distribution(generator)*signal/2)*list[i]; // 0 to + 1.000
-	guessN.set(1,0,y);
-	error = evalError(guessN, vars, forest, guessScope);
+	b = (1+distribution(generator)*signal/2)*list[i]*vars.scale[1]; // 0 to + 1.000
+	b = inBounds(vars,1,list[i]*vars.scale[1],b,(i+distribution(generator))/8,spreadB);
+	if (isnan(b)){
+	  continue;
+	}
+	guessN.set(1,0,b);
+	error = evalError(guessN, vars, x);
 	if (isfinite(error)){
 	  guessList.push_back(Guess(guessN,error)); 
 	}
@@ -284,11 +507,43 @@ std::vector<Guess> findGuessPair(Variables &vars, std::vector<Node*> &forest, Sc
 
 /**
  * Brent method for 1D solution
+ * the bracket is searched inside the bounds of the variable (see VarTable)
  */
-mat brent(std::string var, Node* tree, Scope &guessScope){
+mat brent(int slot, Tape &tape, double* x, const VarTable &vtable){
   // Get a bracket interval for guess: common values in problems
-  double list[16] =  {1e6, 1e4, 6e3, 390, 323, 273, 200, 140, 1, 1e-2, 0, -1e-2, -1, -1e2, -1e4, -1e6};
+  const double common[16] =  {1e6, 1e4, 6e3, 390, 323, 273, 200, 140, 1, 1e-2, 0, -1e-2, -1, -1e2, -1e4, -1e6};
   // 390 - (323) - 140 : Temperature limits for HAPropsSI
+  const double lower = vtable.lower[slot];
+  const double upper = vtable.upper[slot];
+  const double nominal = vtable.nominal[slot];
+  std::vector<double> list;
+  auto add = [&](double value){
+    if (value >= lower && value <= upper){
+      list.push_back(value);
+    }
+  };
+  for (double factor:{1.0, 0.5, 2.0, 0.1, 10.0}){
+    if (nominal > 0){
+      add(factor*nominal);
+    }
+  }
+  for (double value:common){
+    add(value);
+  }
+  if (isfinite(lower) && isfinite(upper)){
+    for (unsigned k=0; k<=10; ++k){
+      add(lower + (upper-lower)*k/10);
+    }
+  } else if (isfinite(lower) || isfinite(upper)){
+    const double bound = isfinite(lower) ? lower : upper;
+    const double sign = isfinite(lower) ? 1 : -1;
+    add(bound);
+    for (double value:common){
+      if (value > 0){
+	add(bound+sign*value);
+      }
+    }
+  }
   
   double a = NAN;
   double b = NAN;
@@ -297,9 +552,9 @@ mat brent(std::string var, Node* tree, Scope &guessScope){
   double error;  
   mat guessN(1,1); 
   // Find a suitable bracket from guess list
-  for (unsigned j=0;j<16;++j){
-    guessScope[var] = list[j];
-    error = tree -> eval(guessScope);
+  for (unsigned j=0;j<list.size();++j){
+    x[slot] = list[j];
+    error = tape.eval(x);
     // Bracket
     if (isfinite(error)){
       if (error > 0){
@@ -354,8 +609,8 @@ mat brent(std::string var, Node* tree, Scope &guessScope){
     } else{
       mflag = false;
     }
-    guessScope[var] = s;
-    fs = tree -> eval(guessScope);
+    x[slot] = s;
+    fs = tape.eval(x);
     d = c;
     c = b;
     fc = fb;
@@ -378,35 +633,46 @@ mat brent(std::string var, Node* tree, Scope &guessScope){
 /**
  * Solver for one dimension problems
  */
-bool solve(Node* tree, Scope &guessScope){
+bool solve(Node* tree, Scope &guessScope, VarTable &vtable){
+  double* x = vtable.values.data();
+
   // Var = number
   if(tree->get_op() == '-'){
     Node** inputs = tree->get_inputs();
     char ltype = inputs[0] -> get_type();
     char rtype = inputs[1] -> get_type();
     if (ltype == 'v' &&
-	(rtype == 'n' || (inputs[1]->findVars(guessScope)).empty()) ){
-      std::string name = inputs[0]->toString();
-      guessScope[name] = inputs[1]->eval(guessScope);
+	(rtype == 'n' || vtable.unknowns(inputs[1]).empty()) ){
+      const int slot = inputs[0]->get_slot();
+      x[slot] = Tape(inputs[1]).eval(x); // shared subtrees once
+      guessScope[vtable.names[slot]] = x[slot];
+      vtable.known[slot] = 1;
       return true;
     } else if (rtype == 'v' &&
-	       (ltype == 'n' || (inputs[0]->findVars(guessScope)).empty()) ){
-      std::string name = inputs[1]->toString();
-      guessScope[name] = inputs[0]->eval(guessScope);
+	       (ltype == 'n' || vtable.unknowns(inputs[0]).empty()) ){
+      const int slot = inputs[1]->get_slot();
+      x[slot] = Tape(inputs[0]).eval(x);
+      guessScope[vtable.names[slot]] = x[slot];
+      vtable.known[slot] = 1;
       return true;
     }
   }
   
   // Brent
-  StringSet vars = tree -> findVars(guessScope);
-  std::string var = *vars.begin();
-  mat guess = brent(var,tree,guessScope); // kinda slow, but reliable
+  const int slot = vtable.unknowns(tree).front();
+  Tape tape(tree);
+  mat guess = brent(slot,tape,x,vtable); // kinda slow, but reliable
 
   // Error
   if (isnan(guess.get(0,0))){
     //throw std::invalid_argument("brent failed @solve");
     return false;
   }
+
+  // Export
+  x[slot] = guess.get(0,0);
+  guessScope[vtable.names[slot]] = x[slot];
+  vtable.known[slot] = 1;
   
   return true;
 }
@@ -416,7 +682,7 @@ bool solve(Node* tree, Scope &guessScope){
  */
 double norm(mat &vector){
   double ans = 0;
-  for (unsigned i=0;i<vector.columns;++i){
+  for (unsigned i=0;i<vector.rows;++i){
     ans += pow(vector.get(i,0),2);
   }
   return sqrt(ans);
@@ -424,40 +690,86 @@ double norm(mat &vector){
 
 
 /**
- * Newton method for multiple dimensions
+ * Norm relative to the nominal values of the names
  */
-bool solve(std::vector<Node*> &forest, Scope &guessScope, unsigned i){
-
-  // Variables
-  Variables vars(forest,guessScope);
-  const unsigned n = vars.all.size();
-
-  // Check size
-  if(n != forest.size()){
-    throw std::invalid_argument("forest size @solve");
+static double norm(const mat &vector, const Variables &vars){
+  double ans = 0;
+  for (int i=0;i<vector.rows;++i){
+    ans += pow(vector.get(i,0)/vars.scale[i],2);
   }
+  return sqrt(ans);
+}
 
-  // Guess
-  std::vector<Guess> guessList;
-  if (n == 2){
-    guessList=findGuessPair(vars,forest,guessScope,i); // better chances of convergence
-  } else{
-    guessList=findGuess(vars,forest,guessScope,i);    
+/**
+ * Equilibrates a jacobian: columns by the nominal values of the names and
+ * rows by their largest entry, kept in rows to scale the residuals
+ */
+static void scaleJacobian(mat &jac, const Variables &vars, std::vector<double> &rows){
+  for (int i=0; i<jac.rows; ++i){
+    double largest = 0;
+    for (int j=0; j<jac.columns; ++j){
+      jac.set(i,j,jac.get(i,j)*vars.scale[j]);
+      largest = std::max(largest,std::abs(jac.get(i,j)));
+    }
+    rows[i] = largest > 0 ? 1/largest : 1;
+    for (int j=0; j<jac.columns; ++j){
+      jac.set(i,j,jac.get(i,j)*rows[i]);
+    }
   }
-  
-  // Guess size
-  if (guessList.size()==0){
-    return false;
+}
+
+/**
+ * Equilibrates a sparse jacobian, see scaleJacobian
+ */
+static void scaleJacobian(spmat &jac, const Variables &vars, std::vector<double> &rows){
+  for (int i=0; i<jac.rows; ++i){
+    double largest = 0;
+    for (int e=jac.start[i]; e<jac.start[i+1]; ++e){
+      jac.values[e] *= vars.scale[jac.index[e]];
+      largest = std::max(largest,std::abs(jac.values[e]));
+    }
+    rows[i] = largest > 0 ? 1/largest : 1;
+    for (int e=jac.start[i]; e<jac.start[i+1]; ++e){
+      jac.values[e] *= rows[i];
+    }
   }
-  
-  // Matrix
-  mat guess(n,1);
+}
+
+/**
+ * Newton method for multiple dimensions
+ */
+bool solve(std::vector<Node*> &forest, Scope &guessScope, VarTable &vtable, unsigned i, Jacobian mode){
+  Variables vars(forest,vtable);
+  return solve(vars,guessScope,vtable,i,mode);
+}
+
+/**
+ * Newton method from one guess
+ * x holds the values of the problem, guess ends with the last iterate
+ * stop is checked every iteration to cancel the try
+ * iterates are kept inside the bounds, steps are solved in nominal units
+ */
+static bool newton(Variables &vars, double* x, mat &guess, Jacobian mode,
+		   const std::atomic<bool> &stop){
+  const unsigned n = vars.all.size();
+  std::vector<Tape> &tapes = vars.tapes;
+
+  // Matrix: sparse for large blocks
+  const unsigned sparse_min = 40;
+  const bool sparse = n >= sparse_min;
   mat answers(n,1);
   mat side(n,1);
-  mat jac(n,n);
+  mat jac(sparse ? 1 : n, sparse ? 1 : n);
+  spmat spjac = sparse ? vars.pattern : spmat(); // values of this try
   mat deltaX(n,1);
-  mat deltaF(n,1);
-  mat deltaG(n,1);
+  mat accepted(n,1);           // iterate before a chord step
+  mat rhs(n,1);                // residuals scaled by rows
+  std::vector<double> rows(n,1);
+
+  // Factorization workspace: reused by chord steps
+  std::vector<double> luStore(sparse ? 0 : n*n);
+  std::vector<int> luPivot(n);
+  LU lu(n,luStore.data(),luPivot.data());
 
   // Error doubles
   double error = 1;
@@ -468,173 +780,283 @@ bool solve(std::vector<Node*> &forest, Scope &guessScope, unsigned i){
   // Counters
   const short max = 200;
   const short max_line = 10;
-  const short max_tries = 999; // try everything
   short count = 0;
   short count_line = 0;
 
   // Flags and control
-  bool computed;
-  bool useBroyden;
-  bool nostep;
-
-  // Statistics
-  unsigned evals = 0;
-  unsigned levals = 0;
+  bool computed = false; // flag to indicate if its the calculated Jacobian
+  bool useChord = false; // flag to reuse the last factorization
+  bool nostep = false;
 
   // Line search
   double lambda = 1;
   double lambda_pre = 1;
   
-  for (unsigned g=0; g<guessList.size() && g<max_tries; ++g){
-    //std::cout << "new try" << std::endl;
-    //std::cout << guessList[g].second << std::endl;
-    count = 0;
-    error = 1;
-    error_dx = 1;
-    error_rel = 1;
-    useBroyden = false; // flag to use Broyden method
-    computed = false;   // flag to indicate if its the calculated Jacobian
-    nostep = false;
-    
-    // Fist evaluation
-    guess = guessList[g].first;
-    updateScope(guessScope,vars,guess);
-    evalForest(forest,guessScope,answers,side);
-    error = evalError(answers);
-    evals +=1 ;
+  // Fist evaluation
+  for (unsigned i = 0; i<n; ++i){
+    guess.set(i,0,std::min(std::max(guess.get(i,0),vars.lower[i]),vars.upper[i]));
+  }
+  updateValues(x,vars,guess);
+  evalForest(tapes,x,answers,side);
+  error = evalError(answers);
     
-    // Newton method: create function to eval convergence
-    while (error_dx > 1e-7 && (error_rel > 1e-3 || sqrt(error) > 1e-5) &&
-	   count < max){
-      
+  // Newton method: create function to eval convergence
+  while (error_dx > 1e-7 && (error_rel > 1e-3 || sqrt(error) > 1e-5) &&
+	 count < max){
+    if (stop.load(std::memory_order_relaxed)){
+      return false; // other try converged
+    }
       
-      if (useBroyden){
-	evalBroyden(jac, deltaG, deltaF);
-	computed = false;
-      } else{
-	evalJacobian(forest,guessScope,vars,jac,answers);
-	evals+=1;
-	useBroyden = true;
-	computed = true;
+    if (useChord){
+      computed = false;
+      for (unsigned i = 0; i<n; ++i){
+	accepted.set(i,0,guess.get(i,0));
       }
-
-      // Check if jacobian is valid
-      for (unsigned i=0;i<n;++i){
-	//std::cout << guess.get(i,0) << " ";
-	for (unsigned j=0;j<n;++j){
-	  if (!isfinite(jac.get(i,j))){
-	    nostep = true;
-	    break;
-	  }
-	}
-	if (nostep){
-	  break;
-	}
+    } else if (sparse){
+      evalJacobian(vars,x,spjac,answers,mode);
+      if (vars.scaled){
+	scaleJacobian(spjac,vars,rows);
       }
-      if (nostep){
-	count=max;
-	break;
+      computed = true;
+    } else{
+      evalJacobian(vars,x,jac,answers,mode);
+      if (vars.scaled){
+	scaleJacobian(jac,vars,rows);
       }
-      //std::cout << std::endl;
-
-      // Store values for Broyden method
-      deltaG = mat(guess);
-      deltaF = mat(answers);
+      useChord = true;
+      computed = true;
+    }
 
-      // Update guess
-      deltaX = gaussElimination(jac,answers);
-      // Limits the update - use just for the first iteration
-      for (unsigned i=0;i<n;++i){
-	// Check if step is a finite number
-	if (!isfinite(deltaX.get(i,0))){
+    // Check if jacobian is valid
+    for (unsigned i=0; i<spjac.values.size() && computed; ++i){
+      const double value = spjac.values[i];
+      if (!isfinite(value)){
+	nostep = true;
+	break;
+      }
+    }
+    for (int i=0;i<jac.rows && computed;++i){
+      for (int j=0;j<jac.columns;++j){
+	if (!isfinite(jac.get(i,j))){
 	  nostep = true;
 	  break;
 	}
-	// Break loop
-	if (nostep){
-	  break;
-	}
       }
       if (nostep){
-	count=max;
 	break;
       }
+    }
+    if (nostep){
+      return false;
+    }
+
+    // Update guess
+    for (unsigned i=0; i<n && vars.scaled; ++i){
+      rhs.set(i,0,answers.get(i,0)*rows[i]);
+    }
+    const mat &b = vars.scaled ? rhs : answers;
+    if (sparse){
+      deltaX = sparseElimination(spjac,b);
+    } else if (computed && !lu.factor(jac)){
+      nostep = true; // singular
+    } else{
+      lu.solve(b.eArray,deltaX.eArray);
+    }
+    for (unsigned i=0; i<n && vars.scaled; ++i){
+      deltaX.set(i,0,deltaX.get(i,0)*vars.scale[i]);
+    }
+    // Limits the update - use just for the first iteration
+    for (unsigned i=0;i<n;++i){
+      // Check if step is a finite number
+      if (!isfinite(deltaX.get(i,0))){
+	nostep = true;
+	break;
+      }
+    }
+    if (nostep){
+      return false;
+    }
+
+    // Check max step
+    double guessNorm = norm(guess,vars);
+    double stepNorm = norm(deltaX,vars);
+    if (guessNorm > 0 && stepNorm > guessNorm*1E3){
+      for (unsigned i = 0; i<n; ++i){
+	deltaX.set(i,0,deltaX.get(i,0)*guessNorm*1E3/stepNorm);
+      }
+    }
 
-      // Check max step
-      double guessNorm = norm(guess);
-      double stepNorm = norm(deltaX);
-      if (stepNorm > guessNorm*1E3){
-      	for (unsigned i = 0; i<n; ++i){
-      	  deltaX.set(i,0,deltaX.get(i,0)*guessNorm*1E3/stepNorm);
-      	}
+    // Steps stop before the bounds: names at a bound don't go past it, the
+    // others keep the direction of the step, shortened to half the way to
+    // the nearest bound (as the line search would from a NAN)
+    bool clamped = false;
+    double fraction = 1;
+    for (unsigned i = 0; i<n; ++i){
+      const double value = guess.get(i,0);
+      const double step = deltaX.get(i,0);
+      if ((value <= vars.lower[i] && step < 0) || (value >= vars.upper[i] && step > 0)){
+	deltaX.set(i,0,0);
+	clamped = true;
+      } else if (value+step < vars.lower[i]){
+	fraction = std::min(fraction,0.5*(vars.lower[i]-value)/step);
+      } else if (value+step > vars.upper[i]){
+	fraction = std::min(fraction,0.5*(vars.upper[i]-value)/step);
       }
-      guess += deltaX; // Max step
+    }
+    if (fraction < 1){
+      for (unsigned i = 0; i<n; ++i){
+	deltaX.set(i,0,deltaX.get(i,0)*fraction);
+      }
+      clamped = true;
+    }
+    guess += deltaX; // Max step
+    for (unsigned i = 0; i<n && clamped; ++i){ // rounding
+      guess.set(i,0,std::min(std::max(guess.get(i,0),vars.lower[i]),vars.upper[i]));
+    }
+    if (clamped && evalError(deltaX,guess) <= 1e-7 && sqrt(error) > 1e-5){
+      return false; // stuck at a bound
+    }
       
-      // Line-search loop [Most time is expended here]
-      count_line = 0;
-      lambda = 1;
-      lambda_pre = 1;
-      do {
-	updateScope(guessScope,vars,guess);
-	evalForest(forest,guessScope,answers,side);
-	levals +=1;
-	error_line = evalError(answers);
-	++count_line;
-	// Update guess
-	if (error_line > error || !isfinite(error_line)){
-	  // Make it closer if too bad, otherwise be optimistic
-	  lambda = !isfinite(lambda) ? 0.1 : 0.5;
-	  for (unsigned i = 0; i<n ; ++i){
-	    guess.set(i,0,guess.get(i,0)-deltaX.get(i,0)*lambda_pre*(1-lambda));
-	  }
-	  lambda_pre *= lambda;
+    // Line-search loop [Most time is expended here]
+    count_line = 0;
+    lambda = 1;
+    lambda_pre = 1;
+    do {
+      updateValues(x,vars,guess);
+      evalForest(tapes,x,answers,side);
+      error_line = evalError(answers);
+      ++count_line;
+      // Update guess
+      if (error_line > error || !isfinite(error_line)){
+	// Make it closer if too bad, otherwise be optimistic
+	lambda = !isfinite(lambda) ? 0.1 : 0.5;
+	for (unsigned i = 0; i<n ; ++i){
+	  guess.set(i,0,guess.get(i,0)-deltaX.get(i,0)*lambda_pre*(1-lambda));
 	}
-      } while ((error_line > error || !isfinite(error_line)) &&
-	       count_line < max_line && lambda_pre > 1E-3);
+	lambda_pre *= lambda;
+      }
+    } while ((error_line > error || !isfinite(error_line)) &&
+	     count_line < max_line && lambda_pre > 1E-3);
       
-      // Try again with Jacobian since Broyden has failed
-      if (!computed){
-	useBroyden = false;
-	continue;
-      } else {
-	if(count_line == max_line && count != 0){
-	  // Line-search failed - break
-	  count = max;
-	  break;
+    // Chord steps are kept while they reduce the error quickly,
+    // otherwise try again with Jacobian from the iterate before the step
+    if (!computed){
+      if (count_line != 1 || error_line > 0.5*error){
+	useChord = false;
+	for (unsigned i = 0; i<n; ++i){
+	  guess.set(i,0,accepted.get(i,0));
 	}
+	updateValues(x,vars,guess);
+	evalForest(tapes,x,answers,side);
+	continue;
       }
+    } else if(count_line == max_line && count != 0){
+      // Line-search failed - break
+      return false;
+    }
 
-      // Required for the Broyden method
-      deltaG = guess-deltaG;
-      deltaF -= answers; // -answer bug
-      
-      // Convergence conditions
-      error = error_line;
-      error_rel = evalError(answers,side);
-      error_dx = count !=0 ? evalError(deltaX,guess) : 1;    
-
-      // Check error change <- break earlier
-      if (!isfinite(error)){
-	count = max;
-	break;
-      }    
+    // Convergence conditions
+    error = error_line;
+    error_rel = evalError(answers,side);
+    error_dx = count !=0 ? evalError(deltaX,guess) : 1;    
 
-      ++count;
+    // Check error change <- break earlier
+    if (!isfinite(error)){
+      return false;
     }    
-    
-    // Break guess test loop
-    if (count != max){
-      break;
-    }
+
+    ++count;
   }
+  return count != max;
+}
 
-  if(count == max){
-    //std::cout << "Failure: " << evals << " evals " << levals << " levals" << std::endl;
-    //throw std::invalid_argument("not converged @solve");
-    return false;
+/**
+ * Newton method for a block of variables
+ * vars can be reused between tries
+ * guesses are tried concurrently when the pool has workers, the first
+ * converged try wins and cancels the others
+ */
+bool solve(Variables &vars, Scope &guessScope, VarTable &vtable, unsigned i, Jacobian mode){
+
+  // Variables
+  double* x = vtable.values.data();
+  const unsigned n = vars.all.size();
+  if (mode == SYMBOLIC && vars.derivatives.empty()){
+    vars.derive();
+  }
+
+  // Guess
+  std::vector<Guess> guessList;
+  if (n == 2){
+    guessList=findGuessPair(vars,x,i); // better chances of convergence
+  } else{
+    guessList=findGuess(vars,x,i);    
   }
   
-  //std::cout << "Sucess: " << evals << " evals " << levals << " levals" << std::endl;
+  // Guess size
+  if (guessList.size()==0){
+    return false;
+  }
 
+  std::atomic<bool> stop(false);
+  const unsigned tries = std::min<unsigned>(threadPool.size(),guessList.size());
+  if (tries == 1){
+    // One try after the other
+    bool converged = false;
+    for (unsigned g=0; g<guessList.size() && !converged; ++g){
+      mat guess = guessList[g].first;
+      converged = newton(vars,x,guess,mode,stop);
+    }
+    if (!converged){
+      return false;
+    }
+  } else{
+    // Each concurrent try has its own tapes and values
+    std::vector<Variables> copies(tries,vars);
+    std::atomic<unsigned> next(0);
+    int winner = -1;
+    mat result(n,1);
+    std::mutex lock;
+    threadPool.run(tries,[&](unsigned t){
+      std::vector<double> values;
+      copyValues(x,vars,values);
+      unsigned g;
+      while (!stop.load() && (g = next.fetch_add(1)) < guessList.size()){
+	mat guess = guessList[g].first;
+	if (newton(copies[t],values.data(),guess,mode,stop)){
+	  std::lock_guard<std::mutex> guard(lock);
+	  if (winner == -1){
+	    winner = g;
+	    result = guess;
+	    stop.store(true);
+	  }
+	}
+      }
+    });
+    if (winner == -1){
+      return false;
+    }
+    updateValues(x,vars,result);
+  }
+
+  // Export
+  updateScope(guessScope,vars,vtable);
+
+  return true;
+}
+
+/**
+ * Newton method for a block from a given guess (warm start)
+ */
+bool solve(Variables &vars, const mat &start, Scope &guessScope, VarTable &vtable, Jacobian mode){
+  if (mode == SYMBOLIC && vars.derivatives.empty()){
+    vars.derive();
+  }
+  std::atomic<bool> stop(false);
+  mat guess = start;
+  if (!newton(vars,vtable.values.data(),guess,mode,stop)){
+    return false;
+  }
+  updateScope(guessScope,vars,vtable);
   return true;
 }
@@ -9,40 +9,72 @@
 
 #include "polish.hpp" // expression parser
 #include "matrix.hpp" // matrix -> correct the index
+#include "tape.hpp"   // flat evaluator
+#include "pool.hpp"   // parallel jacobians
+
+/**
+ * Jacobian modes
+ * NUMERIC: finite differences, FORWARD: dual numbers (exact)
+ * REVERSE: adjoint sweep, a full row per equation (exact)
+ * SYMBOLIC: cached derivative trees (exact)
+ */
+enum Jacobian {NUMERIC, FORWARD, REVERSE, SYMBOLIC};
 
 /**
  * Variables
- * stores names and a table for faster jacobians
+ * stores names, slots and a table for faster jacobians
+ * equations are lowered into tapes once per block
  */
 struct Variables{
   StringSet all;
-  bool* table; // if a equation has or not a variable name
+  std::vector<int> slots; // slot of each name in all
+  spmat pattern; // names of each equation (columns of all), zero values
   int n;
-  Variables(const std::vector<Node*> &forest, Scope &local);
-  ~Variables(){delete[] table;};
+  std::vector<Node*> forest;    // equations (not owned)
+  std::vector<Tape> tapes;      // equations for evaluation
+  std::vector<int> derivatives; // tape of each pattern entry (-1 if none)
+  std::vector<Node*> dtrees;    // derivative trees (owned, copies have none)
+  std::vector<Tape> dtapes;     // derivative trees for evaluation
+  int width;                    // number of values in the table
+  std::vector<int> inputs;      // slots read by the tapes (known or not)
+  unsigned long cost;           // of evaluating every tape once
+  std::vector<double> lower, upper; // bounds of each name in all
+  std::vector<double> scale;    // nominal magnitude of each name (or 1)
+  bool scaled;                  // some nominal was declared
+  Variables(const std::vector<Node*> &forest, const VarTable &vtable);
+  ~Variables();
   Variables(const Variables &original);
+  Variables& operator=(const Variables &original)=delete;
+  void derive();
+  void fold(const double* x);
 };
 
-double dfdx(Node* &tree, Scope &guess, std::string name, double y);
-void evalForest(const std::vector<Node*> &forest, Scope &guess, mat &answers, mat &side);
+double dfdx(Tape &tape, double* x, int slot, double y);
+void evalForest(std::vector<Tape> &tapes, const double* x, mat &answers, mat &side);
 
-void evalJacobian(std::vector<Node*> &forest, Scope &guess,const Variables &vars, mat &jac, mat &answers);
+double evalEntry(Variables &vars, double* x, unsigned i, int k, double y, Jacobian mode);
+void evalJacobian(Variables &vars, double* x, mat &jac, mat &answers, Jacobian mode);
+void evalJacobian(Variables &vars, double* x, spmat &jac, mat &answers, Jacobian mode);
 void evalBroyden(mat &jac, mat &dx, mat &df);
 
-void updateScope(Scope &guess,const Variables &vars, const mat &guessN);
+void updateValues(double* x,const Variables &vars, const mat &guessN);
+void copyValues(const double* x, const Variables &vars, std::vector<double> &values);
+void updateScope(Scope &guess,const Variables &vars, VarTable &vtable);
   
 double evalError(const mat &answers);
 double evalError(const mat &answers,const mat &side);
-double evalError(const mat &guessN, Variables &vars, std::vector<Node*> &forest, Scope &guessScope);
+double evalError(const mat &guessN, Variables &vars, double* x);
 
 using Guess = std::pair<mat,double>;
 bool lessError(Guess first, Guess second);
 
-std::vector<Guess> findGuess(Variables &vars, std::vector<Node*> &forest, Scope &guessScope);
-std::vector<Guess> findGuessPair(Variables &vars, std::vector<Node*> &forest, Scope &guessScope);
+std::vector<Guess> findGuess(Variables &vars, double* x, unsigned i);
+std::vector<Guess> findGuessPair(Variables &vars, double* x, unsigned i);
 
-mat brent(std::string var, Node* tree, Scope &guessScope);
-bool solve(Node* tree, Scope &guessScope);
-bool solve(std::vector<Node*> &forest, Scope &guessScope, unsigned i);
+mat brent(int slot, Tape &tape, double* x, const VarTable &vtable);
+bool solve(Node* tree, Scope &guessScope, VarTable &vtable);
+bool solve(std::vector<Node*> &forest, Scope &guessScope, VarTable &vtable, unsigned i, Jacobian mode=REVERSE);
+bool solve(Variables &vars, Scope &guessScope, VarTable &vtable, unsigned i, Jacobian mode=REVERSE);
+bool solve(Variables &vars, const mat &start, Scope &guessScope, VarTable &vtable, Jacobian mode=REVERSE);
 
 #endif //_SOLVER_
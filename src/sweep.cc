@@ -0,0 +1,151 @@
+#include "sweep.hpp" // prototypes
+#include <sstream>   // split lines
+#include <cmath>     // grid size
+
+/**
+ * Splits a line by commas and trims the fields
+ */
+static std::vector<std::string> fields(const std::string &line){
+  std::vector<std::string> out;
+  std::stringstream stream(line);
+  std::string field;
+  while (std::getline(stream,field,',')){
+    const std::size_t first = field.find_first_not_of(" \t\r");
+    if (first != std::string::npos){
+      out.push_back(field.substr(first,field.find_last_not_of(" \t\r")-first+1));
+    }
+  }
+  return out;
+}
+
+/**
+ * Get the points of a sweep from a file
+ * a table: "name, name, ..." followed by rows of values, or
+ * a grid: one "name = start:step:end" line per parameter
+ */
+Sweep getSweepFromFile(std::string filename){
+  std::ifstream file(filename);
+  Sweep table;
+  std::vector<std::vector<double>> axes; // grid
+  std::string line;
+  while (std::getline(file,line)){
+    line = line.substr(0,line.find('#'));
+    if (line.find_first_not_of(" \t\r") == std::string::npos){
+      continue;
+    }
+    const std::size_t equal = line.find('=');
+    if (equal != std::string::npos){
+      // Grid axis
+      std::vector<std::string> name = fields(line.substr(0,equal));
+      double start, step, end;
+      char colon1, colon2;
+      std::stringstream range(line.substr(equal+1));
+      if (name.size() != 1 || !(range >> start >> colon1 >> step >> colon2 >> end) ||
+	  colon1 != ':' || colon2 != ':' || step <= 0 || end < start){
+	throw std::invalid_argument("grid axis @getSweepFromFile");
+      }
+      table.names.push_back(name[0]);
+      axes.push_back(std::vector<double>());
+      // Counted once, the end is kept for any sign (rounding of the step)
+      const unsigned count = std::floor((end-start)/step+1e-9)+1;
+      for (unsigned k=0; k<count; ++k){
+	axes.back().push_back(start+k*step);
+      }
+    } else if (table.names.empty()){
+      table.names = fields(line);
+    } else{
+      // Table row
+      std::vector<std::string> values = fields(line);
+      if (values.size() != table.names.size()){
+	throw std::invalid_argument("row size @getSweepFromFile");
+      }
+      std::vector<double> point;
+      for (const auto &value:values){
+	point.push_back(std::stod(value));
+      }
+      table.points.push_back(point);
+    }
+  }
+  file.close();
+
+  // Grid points, the last axis changes first (neighbours are close)
+  if (!axes.empty()){
+    if (!table.points.empty()){
+      throw std::invalid_argument("grid and table @getSweepFromFile");
+    }
+    std::vector<unsigned> index(axes.size(),0);
+    while (true){
+      std::vector<double> point;
+      for (unsigned k=0; k<axes.size(); ++k){
+	point.push_back(axes[k][index[k]]);
+      }
+      table.points.push_back(point);
+      int k = axes.size()-1;
+      while (k >= 0 && ++index[k] == axes[k].size()){
+	index[k--] = 0;
+      }
+      if (k < 0){
+	break;
+      }
+    }
+  }
+  return table;
+}
+
+/**
+ * Solves a model at every point of a sweep
+ * points are split in contiguous chunks solved in parallel, each point
+ * starts from the solution of the previous one (its neighbour in the table)
+ * failed points are left empty, the property counters are of the sweep
+ */
+std::vector<Scope> sweep(const Model &model, const Sweep &table){
+  const unsigned count = table.points.size();
+  std::vector<Scope> results(count);
+  propsCache.resetCounters(); // points are solved concurrently
+  if (count == 0){
+    return results;
+  }
+  auto inputs = [&table](unsigned p){
+    Scope point;
+    for (unsigned k=0; k<table.names.size(); ++k){
+      point[table.names[k]] = table.points[p][k];
+    }
+    return point;
+  };
+  auto solvePoint = [&](unsigned p, Model::Workspace &work, const Scope *warm){
+    try{
+      model.solve(inputs(p),results[p],work,warm);
+    } catch (std::exception &e){
+      results[p].clear();
+    }
+    return results[p].empty() ? warm : &results[p];
+  };
+
+  // First point from the usual guesses
+  Model::Workspace first = model.workspace();
+  const Scope* seed = solvePoint(0,first,nullptr);
+
+  // Chunks, each with its own workspace
+  const unsigned chunks = std::min(count-1,threadPool.size());
+  std::vector<Model::Workspace> works;
+  works.reserve(chunks);
+  for (unsigned c=0; c<chunks; ++c){
+    works.push_back(model.workspace());
+  }
+  auto begin = [&](unsigned c){return 1+(count-1)*c/chunks;};
+
+  // Heads of the chunks in order, each from the head before it (the
+  // nearest solved point), then the rest of the chunks in parallel
+  std::vector<const Scope*> heads(chunks);
+  for (unsigned c=0; c<chunks; ++c){
+    seed = solvePoint(begin(c),works[c],seed);
+    heads[c] = seed;
+  }
+  threadPool.run(chunks,[&](unsigned c){
+    const Scope* warm = heads[c];
+    for (unsigned p=begin(c)+1; p<begin(c+1); ++p){
+      warm = solvePoint(p,works[c],warm);
+    }
+  });
+  return results;
+}
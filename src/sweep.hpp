@@ -0,0 +1,18 @@
+#ifndef _SWEEP_
+#define _SWEEP_
+
+#include "model.hpp" // compiled model
+
+/**
+ * Sweep
+ * names of the parameters and their values at each point
+ */
+struct Sweep{
+  std::vector<std::string> names;
+  std::vector<std::vector<double>> points;
+};
+
+Sweep getSweepFromFile(std::string filename);
+std::vector<Scope> sweep(const Model &model, const Sweep &table);
+
+#endif // _SWEEP_
@@ -0,0 +1,505 @@
+#include "tape.hpp" // prototypes
+#include <algorithm> // find
+
+/**
+ * Tape constructor
+ */
+Tape::Tape(Node* tree){
+  std::unordered_map<Node*,int> uses;
+  countUses(tree,uses);
+  int max = 0;
+  compile(tree,0,max,uses);
+  stack.resize(max);
+  tangent.resize(max);
+  dsaved.resize(saved.size());
+
+  // Local derivatives: one per operand
+  unsigned count = 0;
+  for (const auto &ins:code){
+    count += arity(ins);
+  }
+  partials.resize(count);
+  needed.assign(count,1);
+  columns.assign(code.size(),-1);
+}
+
+/**
+ * Rough cost of an evaluation (a function call is worth many operations)
+ */
+unsigned long Tape::cost() const{
+  unsigned long total = code.size();
+  for (const auto &ins:code){
+    if (ins.code == 'c'){
+      total += 1000;
+    }
+  }
+  return total;
+}
+
+/**
+ * Number of operands of an instruction
+ */
+int Tape::arity(const Instruction &ins){
+  switch (ins.code){
+  case 'n': case 'v': case 'L':
+    return 0;
+  case 'f': case 'S':
+    return 1;
+  case 'c':
+    return ins.arg;
+  default:
+    return 2;
+  }
+}
+
+/**
+ * Counts the parents of each shared operation and function in a tree
+ * a node with one owner can't be repeated in the tree
+ */
+void Tape::countUses(Node* tree, std::unordered_map<Node*,int> &uses){
+  const char type = tree->get_type();
+  if ((type != 'o' && type != 'f') || (tree->refs > 1 && ++uses[tree] > 1)){
+    return;
+  }
+  const int n = tree->get_n();
+  Node** inputs = tree->get_inputs();
+  for (int i=0; i<n; ++i){
+    countUses(inputs[i],uses);
+  }
+}
+
+/**
+ * Lowers a tree into postfix instructions
+ * depth is the stack size before the tree is evaluated
+ * subtrees with several parents are saved after the first evaluation,
+ * uses is changed to -1-index of the saved value
+ */
+void Tape::compile(Node* tree, int depth, int &max, std::unordered_map<Node*,int> &uses){
+  Instruction ins;
+  ins.arg = 0;
+  auto shared = uses.find(tree);
+  if (shared != uses.end() && shared->second < 0){
+    ins.code = 'L';
+    ins.arg = -1-shared->second;
+    code.push_back(ins);
+    if (depth+1 > max){
+      max = depth+1;
+    }
+    return;
+  }
+  ins.code = tree->get_type();
+  switch (ins.code){
+  case 'n':
+    ins.value = tree->eval(nullptr);
+    break;
+  case 'v':
+    ins.arg = tree->get_slot();
+    break;
+  case 'o':
+    {
+      Node** inputs = tree->get_inputs();
+      compile(inputs[0],depth,max,uses);
+      compile(inputs[1],depth+1,max,uses);
+      ins.code = tree->get_op();
+    }
+    break;
+  case 'f':
+    {
+      // Words are not stored in the stack
+      const int n = tree->get_n();
+      Node** inputs = tree->get_inputs();
+      for (int i=0; i<n; ++i){
+	if (inputs[i]->get_type() != 'w'){
+	  compile(inputs[i],depth+ins.arg,max,uses);
+	  ++ins.arg;
+	}
+      }
+      if (n == 1){
+	ins.arg = tree->get_op();
+      } else{
+	ins.code = 'c';
+	ins.fun = static_cast<NodeFun*>(tree);
+      }
+    }
+    break;
+  default:
+    throw std::invalid_argument("node @Tape");
+  }
+  code.push_back(ins);
+  if (depth+1 > max){
+    max = depth+1;
+  }
+  if (shared != uses.end() && shared->second > 1){
+    ins.code = 'S';
+    ins.arg = saved.size();
+    code.push_back(ins);
+    shared->second = -1-ins.arg;
+    saved.push_back(0);
+  }
+}
+
+/**
+ * Runs the instructions of a list from begin until end
+ * returns a pointer to the top of the stack
+ */
+double* Tape::run(const std::vector<Instruction> &list, const double* x, unsigned begin, unsigned end){
+  double* top = stack.data()-1;
+  for (unsigned i=begin; i<end; ++i){
+    const Instruction &ins = list[i];
+    switch (ins.code){
+    case 'n':
+      *++top = ins.value;
+      break;
+    case 'v':
+      *++top = x[ins.arg];
+      break;
+    case '+':
+      --top;
+      *top += top[1];
+      break;
+    case '-':
+      --top;
+      *top -= top[1];
+      break;
+    case '*':
+      --top;
+      *top *= top[1];
+      break;
+    case '/':
+      --top;
+      *top /= top[1];
+      break;
+    case '^':
+      --top;
+      *top = pow(*top,top[1]);
+      break;
+    case 'f':
+      *top = evalFunOne(ins.arg,*top);
+      break;
+    case 'c':
+      top += 1-ins.arg;
+      *top = ins.fun->call(top);
+      break;
+    case 'S':
+      saved[ins.arg] = *top;
+      break;
+    case 'L':
+      *++top = saved[ins.arg];
+      break;
+    default:
+      throw std::invalid_argument("code @Tape::run");
+    }
+  }
+  return top;
+}
+
+/**
+ * Tape eval
+ */
+double Tape::eval(const double* x){
+  return *run(code,x,0,code.size());
+}
+
+/**
+ * Evaluates both sides of the root operation
+ */
+void Tape::evalSides(const double* x, double &left, double &right){
+  run(code,x,0,code.size()-1);
+  left = stack[0];
+  right = stack[1];
+}
+
+/**
+ * Forward mode: evaluates value and derivative with respect to a slot
+ * carrying dual numbers (value, tangent) through the stack
+ */
+double Tape::evalDual(const double* x, int slot, double &value){
+  double* top = stack.data()-1;
+  double* dtop = tangent.data()-1;
+  double a, b, y, d;
+  for (const auto &ins:code){
+    switch (ins.code){
+    case 'n':
+      *++top = ins.value;
+      *++dtop = 0;
+      break;
+    case 'v':
+      *++top = x[ins.arg];
+      *++dtop = ins.arg == slot ? 1 : 0;
+      break;
+    case '+':
+      --top; --dtop;
+      *top += top[1];
+      *dtop += dtop[1];
+      break;
+    case '-':
+      --top; --dtop;
+      *top -= top[1];
+      *dtop -= dtop[1];
+      break;
+    case '*':
+      --top; --dtop;
+      *dtop = *dtop*top[1] + *top*dtop[1];
+      *top *= top[1];
+      break;
+    case '/':
+      --top; --dtop;
+      *dtop = (*dtop*top[1] - *top*dtop[1])/(top[1]*top[1]);
+      *top /= top[1];
+      break;
+    case '^':
+      --top; --dtop;
+      a = *top;
+      b = top[1];
+      y = pow(a,b);
+      d = 0;
+      if (*dtop != 0){
+	d += b*pow(a,b-1)*(*dtop);
+      }
+      if (dtop[1] != 0){
+	d += y*log(a)*dtop[1]; // only when the exponent changes
+      }
+      *top = y;
+      *dtop = d;
+      break;
+    case 'f':
+      if (*dtop != 0){
+	*dtop *= diffFunOne(ins.arg,*top);
+      }
+      *top = evalFunOne(ins.arg,*top);
+      break;
+    case 'c':
+      top += 1-ins.arg;
+      dtop += 1-ins.arg;
+      y = ins.fun->call(top);
+      d = 0;
+      for (int k=0; k<ins.arg; ++k){
+	if (dtop[k] != 0){
+	  d += ins.fun->partial(top,k,y)*dtop[k];
+	}
+      }
+      *top = y;
+      *dtop = d;
+      break;
+    case 'S':
+      saved[ins.arg] = *top;
+      dsaved[ins.arg] = *dtop;
+      break;
+    case 'L':
+      *++top = saved[ins.arg];
+      *++dtop = dsaved[ins.arg];
+      break;
+    default:
+      throw std::invalid_argument("code @Tape::evalDual");
+    }
+  }
+  value = *top;
+  return *dtop;
+}
+
+/**
+ * Marks the operands that have unknowns, only they are derived
+ * returns if the value of each instruction has unknowns
+ */
+std::vector<char> Tape::mark(){
+  std::vector<char> active; // if the operand has unknowns
+  std::vector<char> activeSaved(saved.size(),0);
+  std::vector<char> any(code.size(),0);
+  unsigned pos = 0;
+  for (const auto &ins:code){
+    pos += arity(ins);
+  }
+  needed.assign(pos,0);
+  pos = 0;
+  for (unsigned i=0; i<code.size(); ++i){
+    const Instruction &ins = code[i];
+    const int m = arity(ins);
+    if (ins.code == 'v'){
+      any[i] = columns[i] >= 0;
+    } else if (ins.code == 'L'){
+      any[i] = activeSaved[ins.arg];
+    }
+    for (int k=0; k<m; ++k){
+      needed[pos+k] = active[active.size()-m+k];
+      any[i] = any[i] || needed[pos+k];
+    }
+    active.resize(active.size()-m);
+    active.push_back(any[i]);
+    if (ins.code == 'S'){
+      activeSaved[ins.arg] = any[i];
+    }
+    pos += m;
+  }
+  return any;
+}
+
+/**
+ * Binds variables to the columns of a Jacobian row
+ * slots are the unknowns, operands without unknowns are not derived and
+ * the largest subtrees without unknowns are kept for fold
+ */
+void Tape::bind(const std::vector<int> &slots){
+  for (unsigned i=0; i<code.size(); ++i){
+    if (code[i].code == 'v'){
+      auto it = std::find(slots.begin(),slots.end(),code[i].arg);
+      columns[i] = it == slots.end() ? -1 : it-slots.begin();
+    }
+  }
+  const std::vector<char> any = mark();
+
+  // Operands without unknowns of an instruction with unknowns
+  std::vector<unsigned> first; // first instruction of each operand
+  std::vector<unsigned> last;  // last instruction of each operand
+  constants.clear();
+  for (unsigned i=0; i<code.size(); ++i){
+    const int m = arity(code[i]);
+    const unsigned begin = m > 0 ? first[first.size()-m] : i;
+    for (int k=0; k<m && any[i]; ++k){
+      const unsigned operand = last[last.size()-m+k];
+      if (!any[operand]){
+	constants.push_back(std::make_pair(first[first.size()-m+k],operand));
+      }
+    }
+    first.resize(first.size()-m);
+    last.resize(last.size()-m);
+    first.push_back(begin);
+    last.push_back(i);
+  }
+  std::sort(constants.begin(),constants.end());
+}
+
+/**
+ * Folds the subtrees without unknowns into numbers
+ * x holds the values of the known variables, the tape is folded again
+ * from its instructions at each call (when the known values change)
+ */
+void Tape::fold(const double* x){
+  if (full.empty()){
+    full = code;
+    fullColumns = columns;
+  }
+  code.clear();
+  columns.clear();
+  unsigned next = 0;
+  for (const auto &constant:constants){
+    code.insert(code.end(),full.begin()+next,full.begin()+constant.first);
+    columns.insert(columns.end(),fullColumns.begin()+next,fullColumns.begin()+constant.first);
+    Instruction ins;
+    ins.code = 'n';
+    ins.arg = 0;
+    ins.value = *run(full,x,constant.first,constant.second+1); // saved values are kept
+    code.push_back(ins);
+    columns.push_back(-1);
+    next = constant.second+1;
+  }
+  code.insert(code.end(),full.begin()+next,full.end());
+  columns.insert(columns.end(),fullColumns.begin()+next,fullColumns.end());
+  mark();
+}
+
+/**
+ * Reverse mode: evaluates the tape and adds its gradient to a Jacobian row
+ * a forward pass records local derivatives and a backward sweep
+ * propagates adjoints from the root to the variables
+ */
+double Tape::evalGradient(const double* x, double* row){
+  // Forward pass
+  double* top = stack.data()-1;
+  double* d = partials.data();
+  const char* need = needed.data();
+  double a, b, y;
+  for (const auto &ins:code){
+    switch (ins.code){
+    case 'n':
+      *++top = ins.value;
+      break;
+    case 'v':
+      *++top = x[ins.arg];
+      break;
+    case '+':
+      --top;
+      *top += top[1];
+      d[0] = 1;
+      d[1] = 1;
+      break;
+    case '-':
+      --top;
+      *top -= top[1];
+      d[0] = 1;
+      d[1] = -1;
+      break;
+    case '*':
+      --top;
+      d[0] = top[1];
+      d[1] = *top;
+      *top *= top[1];
+      break;
+    case '/':
+      --top;
+      a = *top;
+      b = top[1];
+      d[0] = 1/b;
+      d[1] = -a/(b*b);
+      *top = a/b;
+      break;
+    case '^':
+      --top;
+      a = *top;
+      b = top[1];
+      y = pow(a,b);
+      d[0] = need[0] ? b*pow(a,b-1) : 0;
+      d[1] = need[1] ? y*log(a) : 0;
+      *top = y;
+      break;
+    case 'f':
+      d[0] = need[0] ? diffFunOne(ins.arg,*top) : 0;
+      *top = evalFunOne(ins.arg,*top);
+      break;
+    case 'c':
+      top += 1-ins.arg;
+      y = ins.fun->call(top);
+      for (int k=0; k<ins.arg; ++k){
+	d[k] = need[k] ? ins.fun->partial(top,k,y) : 0;
+      }
+      *top = y;
+      break;
+    case 'S':
+      saved[ins.arg] = *top;
+      d[0] = 1;
+      break;
+    case 'L':
+      *++top = saved[ins.arg];
+      break;
+    default:
+      throw std::invalid_argument("code @Tape::evalGradient");
+    }
+    const int m = arity(ins);
+    d += m;
+    need += m;
+  }
+  const double value = *top;
+
+  // Backward sweep: the last operand is on the top of the adjoint stack
+  // adjoints of saved values are gathered from their loads
+  double* adj = tangent.data();
+  *adj = 1;
+  std::fill(dsaved.begin(),dsaved.end(),0);
+  for (int i=code.size()-1; i>=0; --i){
+    const Instruction &ins = code[i];
+    const int m = arity(ins);
+    d -= m;
+    need -= m;
+    a = *adj--;
+    if (ins.code == 'v' && columns[i] >= 0){
+      row[columns[i]] += a;
+    } else if (ins.code == 'L'){
+      dsaved[ins.arg] += a;
+    } else if (ins.code == 'S'){
+      a += dsaved[ins.arg];
+    }
+    for (int k=0; k<m; ++k){
+      *++adj = need[k] ? a*d[k] : 0;
+    }
+  }
+  return value;
+}
@@ -0,0 +1,58 @@
+#ifndef _TAPE_
+#define _TAPE_
+
+#include <vector>     // instructions and stack
+#include <unordered_map> // shared subtrees
+#include "node.hpp"   // trees
+
+/**
+ * Instruction
+ * code: 'n' number, 'v' variable, '+-*^/' operation,
+ *       'f' function of one input, 'c' call of a function node,
+ *       'S' save the top of the stack, 'L' load a saved value
+ */
+struct Instruction{
+  char code;
+  int arg;         // slot, function code, number of arguments or saved value
+  union{
+    double value;  // number
+    NodeFun* fun;  // function node (owned by the tree)
+  };
+};
+
+/**
+ * Tape
+ * a tree lowered into postfix instructions, evaluated over a value stack
+ * shared subtrees are evaluated once and saved
+ * the tree has to outlive the tape
+ * a bound tape can be folded: subtrees without unknowns become numbers
+ */
+class Tape{
+  std::vector<Instruction> code;
+  std::vector<double> stack;
+  std::vector<double> tangent; // derivatives of the stack (or adjoints)
+  std::vector<double> partials; // local derivatives of each operation
+  std::vector<char> needed;     // if a local derivative is required
+  std::vector<int> columns;     // column of each variable (-1 if known)
+  std::vector<double> saved;    // values of shared subtrees
+  std::vector<double> dsaved;   // derivatives of saved values (or adjoints)
+  std::vector<Instruction> full; // instructions before folding
+  std::vector<int> fullColumns;
+  std::vector<std::pair<unsigned,unsigned>> constants; // first and last instruction of the subtrees without unknowns
+  static void countUses(Node* tree, std::unordered_map<Node*,int> &uses);
+  void compile(Node* tree, int depth, int &max, std::unordered_map<Node*,int> &uses);
+  static int arity(const Instruction &ins);
+  double* run(const std::vector<Instruction> &list, const double* x, unsigned begin, unsigned end);
+  std::vector<char> mark();
+public:
+  Tape(Node* tree);
+  double eval(const double* x);
+  void evalSides(const double* x, double &left, double &right);
+  double evalDual(const double* x, int slot, double &value);
+  void bind(const std::vector<int> &slots);
+  void fold(const double* x);
+  double evalGradient(const double* x, double* row);
+  unsigned long cost() const;
+};
+
+#endif // _TAPE_
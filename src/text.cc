@@ -13,6 +13,44 @@ std::string minusExp(std::string equation){
   return exp;
 }
 
+/**
+ * Verifies if a line is a directive: @name(arg, ...)
+ */
+bool isDirective(const std::string &line){
+  const std::size_t first = line.find_first_not_of(' ');
+  return first != std::string::npos && line[first] == '@';
+}
+
+/**
+ * Name and arguments of a directive
+ * @backend(TTSE, Water) -> backend, {TTSE, Water}
+ */
+std::vector<std::string> directiveArgs(const std::string &line, std::string &name){
+  const std::size_t at = line.find('@');
+  const std::size_t open = line.find('(');
+  const std::size_t close = line.rfind(')');
+  if (open == std::string::npos || close == std::string::npos || close < open){
+    throw std::invalid_argument("directive without '(...)' @directiveArgs");
+  }
+  name = line.substr(at+1,open-at-1);
+  name.erase(name.find_last_not_of(' ')+1);
+  std::vector<std::string> args;
+  std::size_t start = open+1;
+  while (start <= close){
+    std::size_t end = line.find(',',start);
+    if (end == std::string::npos || end > close){
+      end = close;
+    }
+    std::string arg = line.substr(start,end-start);
+    const std::size_t first = arg.find_first_not_of(" \t");
+    if (first != std::string::npos){
+      args.push_back(arg.substr(first,arg.find_last_not_of(" \t")-first+1));
+    }
+    start = end+1;
+  }
+  return args;
+}
+
 /**
  * Break sublines and remove comments
  */
@@ -48,7 +86,9 @@ std::vector<std::string> getLinesFromFile(std::string filename){
   while (std::getline(file,line)){
     while (!line.empty()){
       subline = breakLines(line);
-      if (!subline.empty()){
+      if (isDirective(subline)){
+	lines.push_back(subline);
+      } else if (!subline.empty()){
 	lines.push_back(minusExp(subline));
       }
     }
@@ -84,7 +124,9 @@ std::vector<std::string> getLinesFromText(std::string text){
   for (auto &line:lines){
     while (!line.empty()){
       subline = breakLines(line);
-      if (!subline.empty()){
+      if (isDirective(subline)){
+  	linesClear.push_back(subline);
+      } else if (!subline.empty()){
   	linesClear.push_back(minusExp(subline));
       }
     }
@@ -9,5 +9,7 @@ std::string minusExp(std::string equation);
 std::string breakLines(std::string &text);
 std::vector<std::string> getLinesFromFile(std::string filename);
 std::vector<std::string> getLinesFromText(std::string text);
+bool isDirective(const std::string &line);
+std::vector<std::string> directiveArgs(const std::string &line, std::string &name);
 
 #endif
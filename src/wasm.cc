@@ -1,9 +1,17 @@
 #include "text.hpp"   // input text and manipulation
 #include "solver.hpp" // numerical solver
 #include "reduce.hpp" // block solver and problem solver
+#include "model.hpp"  // compiled problem
 #include <emscripten/bind.h> // wasm
 #include <emscripten.h> // wasm
 
+/* *
+ * Last analyzed problem (reused while the text does not change)
+ */
+static std::vector<std::string> lastLines;
+static Model* lastModel = nullptr;
+static Scope lastSolution; // first guess after an edit
+
 /* *
  * Evaluates the problem from a string
  * Function call for wasm
@@ -11,18 +19,20 @@
 std::string solveText(std::string text){
   srand(time(NULL)); // seed for random numbers
 
-  // Get expressions lines
+  // Get expressions lines (@guess lines are kept by the model)
   std::vector<std::string> lines = getLinesFromText(text);
-  // Extract only problem lines and keep guess lines without "?"
-  // Parse all guess lines as a problem and store the solution
-  // Use these stored solutions to alter the behaviour of findGuesses
-
   
   /**
-   * Solve
+   * Solve, starting from the last solution
    **/
-  Scope solutions;
-  solveProblem(lines,solutions);
+  if (lastModel == nullptr || lines != lastLines){
+    delete lastModel;
+    lastModel = nullptr;
+    lastModel = new Model(lines);
+    lastLines = lines;
+  }
+  Scope solutions = lastModel->solve(Scope(),lastSolution.empty() ? nullptr : &lastSolution);
+  lastSolution = solutions;
   
   // give solution
   std::string res="{";
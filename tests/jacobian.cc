@@ -0,0 +1,108 @@
+#include "model.hpp" // compiled models and their blocks
+#include <iostream>  // in-out
+
+/**
+ * Jacobian check: ./jacobian model.txt ...
+ * each model is solved, then the Jacobian of every block is evaluated at
+ * the solution in each mode (dense and sparse) and compared with central
+ * differences, entry by entry
+ */
+
+/**
+ * Modes and the largest difference accepted (NUMERIC is a forward difference)
+ */
+struct Mode{
+  Jacobian mode;
+  std::string name;
+  double tolerance;
+};
+const std::vector<Mode> modes =
+  {
+   {NUMERIC,"NUMERIC",1e-4},
+   {FORWARD,"FORWARD",1e-6},
+   {REVERSE,"REVERSE",1e-6},
+   {SYMBOLIC,"SYMBOLIC",1e-6}
+  };
+
+/**
+ * Central differences of the equations of a block
+ */
+mat centralJacobian(Variables &vars, double* x){
+  const int n = vars.n;
+  mat jac(n,n);
+  mat plus(n,1), minus(n,1), side(n,1);
+  for (int j=0; j<n; ++j){
+    const int slot = vars.slots[j];
+    const double x0 = x[slot];
+    const double h = 1e-6*std::max(1.0,std::abs(x0));
+    x[slot] = x0+h;
+    evalForest(vars.tapes,x,plus,side);
+    x[slot] = x0-h;
+    evalForest(vars.tapes,x,minus,side);
+    x[slot] = x0;
+    for (int i=0; i<n; ++i){
+      jac.set(i,j,(minus.get(i,0)-plus.get(i,0))/(2*h)); // answers are minus
+    }
+  }
+  return jac;
+}
+
+/**
+ * Largest difference of an entry, relative to the entry (or 1)
+ */
+double entryError(double value, double expected){
+  return std::abs(value-expected)/std::max(1.0,std::abs(expected));
+}
+
+/**
+ * Checks the blocks of a model, false if a mode is off
+ */
+bool checkModel(const std::string &filename){
+  Model* model = openModel(filename);
+  Model::Workspace work = model->workspace();
+  Scope solutions;
+  model->solve(Scope(),solutions,work);
+  double* x = work.table.values.data();
+  bool ok = true;
+  for (const auto &mode:modes){
+    double error = 0;
+    for (auto &vars:work.vars){
+      const int n = vars.n;
+      if (mode.mode == SYMBOLIC && vars.derivatives.empty()){
+	vars.derive();
+      }
+      mat answers(n,1), side(n,1);
+      evalForest(vars.tapes,x,answers,side);
+      const mat expected = centralJacobian(vars,x);
+      mat jac(n,n);
+      evalJacobian(vars,x,jac,answers,mode.mode);
+      spmat spjac = vars.pattern;
+      evalJacobian(vars,x,spjac,answers,mode.mode);
+      for (int i=0; i<n; ++i){
+	int k = spjac.start[i];
+	for (int j=0; j<n; ++j){
+	  double sparse = 0; // entries out of the pattern are zero
+	  if (k < spjac.start[i+1] && spjac.index[k] == j){
+	    sparse = spjac.values[k++];
+	  }
+	  error = std::max(error,entryError(jac.get(i,j),expected.get(i,j)));
+	  error = std::max(error,entryError(sparse,expected.get(i,j)));
+	}
+      }
+    }
+    const bool passed = error <= mode.tolerance;
+    std::cout << (passed ? "ok   " : "FAIL ") << filename << " " << mode.name
+	      << ": " << error << std::endl;
+    ok = ok && passed;
+  }
+  delete model;
+  return ok;
+}
+
+int main(int argc, char** argv){
+  bool ok = true;
+  for (int i=1; i<argc; ++i){
+    ok = checkModel(argv[i]) && ok;
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Regression models: sh tests/run.sh [./laine]
+# each model.txt is solved once, model.out lists the accepted answers (one
+# per line, name=value rounded to 4 decimals, in alphabetical order, or
+# error=message for a model that throws)
+# a model.csv next to it is a sweep: the answer has the values of every
+# point, one point after the other
+LAINE=${1:-./laine}
+DIR=$(dirname "$0")
+failed=0
+for model in "$DIR"/*.txt; do
+  expected="${model%.txt}.out"
+  points="${model%.txt}.csv"
+  if [ -f "$points" ]; then
+    answer=$("$LAINE" "$model" "$points" 2>/dev/null | awk -F',' '
+      NR == 1 {for (i = 1; i <= NF; ++i) name[i] = $i; next}
+      {
+        for (i = 1; i <= NF; ++i) {
+          v = $i == "nan" ? "nan" : sprintf("%.4f", $i); if (v == "-0.0000") v = "0.0000";
+          printf "%s%s=%s", sep, name[i], v; sep = " "
+        }
+      }
+      END {print ""}')
+  else
+    answer=$( (printf '%s\nn\nn\n' "$model" | "$LAINE" 2>&1) 2>/dev/null | awk -F': ' '
+      NF == 2 && $2 ~ /^-?[0-9.]+(e[-+]?[0-9]+)?$/ {
+        v = sprintf("%.4f", $2); if (v == "-0.0000") v = "0.0000";
+        printf "%s%s=%s", sep, $1, v; sep = " "
+      }
+      /what\(\): / {sub(/.*what\(\): +/, ""); printf "%serror=%s", sep, $0; sep = " "}
+      END {print ""}')
+  fi
+  if grep -qxF "$answer" "$expected"; then
+    echo "ok   $model"
+  else
+    echo "FAIL $model: $answer"
+    failed=1
+  fi
+done
+exit $failed